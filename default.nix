@@ -11,6 +11,7 @@ with import <nixpkgs> {}; {
       gnome3.gtk
       deadbeef
       libxmlxx3
+      curl
     ];
   };
 }
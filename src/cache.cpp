@@ -0,0 +1,877 @@
+#include "cache.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <glib.h>
+
+#include "cache_store.h"
+#include "debug.h"
+#include "utils.h"
+#include "workers.h"
+
+using namespace std;
+using namespace Glib;
+
+static const char *home_cache = getenv("XDG_CACHE_HOME");
+static const string lyrics_dir = (home_cache ? string(home_cache) : string(getenv("HOME")) + "/.cache")
+                               + "/deadbeef/lyrics/";
+
+// the entries remembering that a provider has no lyrics for a song
+static const string MISS_PREFIX = ".miss.";
+
+// the settings needed by every lookup, reread by reload_cache_settings
+static atomic<int> keys_setting{2};
+static atomic<int> backend_setting{0};
+static atomic<int> layout_setting{0};
+
+namespace {
+
+bool is_miss_key(const string &key) {
+	return key.compare(0, MISS_PREFIX.size(), MISS_PREFIX) == 0;
+}
+
+/**
+ * Size-bounded LRU of the lyrics, living in front of the disk cache.
+ */
+class lyrics_lru {
+public:
+	lyrics_ptr get(const string &key);
+	void put(const string &key, lyrics_ptr lyrics);
+	void erase(const string &key);
+	cache_stats stats();
+
+private:
+	using entry = pair<string, lyrics_ptr>;
+
+	static size_t capacity();
+	static size_t entry_size(const entry &e) { return e.first.size() + e.second->size(); }
+	void evict(size_t limit);
+
+	mutex mtx;
+	list<entry> entries; // the most recently used come first
+	unordered_map<string, list<entry>::iterator> index;
+	size_t bytes = 0;
+	size_t hits = 0;
+	size_t misses = 0;
+};
+
+size_t lyrics_lru::capacity() {
+	int kb = deadbeef->conf_get_int("lyricbar.cache.memsize", 1024);
+	return kb > 0 ? size_t(kb) << 10U : 0;
+}
+
+void lyrics_lru::evict(size_t limit) {
+	while (bytes > limit && !entries.empty()) {
+		bytes -= entry_size(entries.back());
+		index.erase(entries.back().first);
+		entries.pop_back();
+	}
+}
+
+lyrics_ptr lyrics_lru::get(const string &key) {
+	lock_guard<mutex> lock(mtx);
+	auto it = index.find(key);
+	if (it == index.end()) {
+		++misses;
+		return nullptr;
+	}
+	++hits;
+	entries.splice(entries.begin(), entries, it->second);
+	return it->second->second;
+}
+
+void lyrics_lru::put(const string &key, lyrics_ptr lyrics) {
+	size_t limit = capacity();
+	lock_guard<mutex> lock(mtx);
+	auto it = index.find(key);
+	if (it != index.end()) {
+		bytes -= entry_size(*it->second);
+		entries.erase(it->second);
+		index.erase(it);
+	}
+	entries.emplace_front(key, move(lyrics));
+	index.emplace(key, entries.begin());
+	bytes += entry_size(entries.front());
+	evict(limit);
+}
+
+void lyrics_lru::erase(const string &key) {
+	lock_guard<mutex> lock(mtx);
+	auto it = index.find(key);
+	if (it != index.end()) {
+		bytes -= entry_size(*it->second);
+		entries.erase(it->second);
+		index.erase(it);
+	}
+}
+
+cache_stats lyrics_lru::stats() {
+	lock_guard<mutex> lock(mtx);
+	return {hits, misses, entries.size(), bytes};
+}
+
+/**
+ * Keeps the lyrics of every song in a file of its own. The file is named
+ * either after the key or, in the hashed layout, after the SHA-1 of the key,
+ * sharded into two levels of directories by its first bytes (ab/cd/abcd...),
+ * so that the names are never too long and the directories stay small.
+ */
+class file_backend : public cache_backend {
+public:
+	explicit file_backend(bool hashed);
+
+	lyrics_ptr load(const string &key) override;
+	bool save(const string &key, const string &lyrics) override;
+	bool contains(const string &key) override;
+	bool remove(const string &key) override;
+	void for_each_key(const function<bool(const string &)> &f) override;
+	string entry_id(const string &key) override;
+	void stop() override { stopping = true; }
+
+private:
+	static string flat_name(const string &key) { return lyrics_dir + key; }
+	string filename(const string &key);
+	void migrate();
+
+	const bool hashed;
+	// whether the files of the flat layout have been moved into the hashed one
+	atomic<bool> migrated;
+	atomic<bool> stopping{false};
+};
+
+static const string hashed_dir = lyrics_dir + "hashed/";
+static const string migrated_marker = hashed_dir + ".migrated";
+
+/**
+ * Tells whether the entry is a directory, asking the filesystem
+ * if it does not fill in the type.
+ */
+static
+bool is_directory(DIR *dir, const dirent *entry) {
+	if (entry->d_type != DT_UNKNOWN)
+		return entry->d_type == DT_DIR;
+	struct stat st;
+	return fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+// the temporary files older than this were left behind by a crash
+constexpr time_t STALE_TMP_AGE = 60;
+
+/**
+ * Calls the function with the name of every cached file in the directory,
+ * removing the stale temporary files on the way.
+ */
+static
+bool for_each_file(const string &dir_name, const function<bool(const string &)> &f) {
+	unique_ptr<DIR, int(*)(DIR *)> dir{opendir(dir_name.c_str()), &closedir};
+	if (!dir)
+		return true;
+	static const string tmp_suffix = ".tmp";
+	while (dirent *entry = readdir(dir.get())) {
+		string name = entry->d_name;
+		if (name == "." || name == ".." || is_directory(dir.get(), entry))
+			continue;
+		if (name.size() >= tmp_suffix.size()
+		        && name.compare(name.size() - tmp_suffix.size(), tmp_suffix.size(), tmp_suffix) == 0) {
+			struct stat st;
+			if (fstatat(dirfd(dir.get()), name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0
+			        && st.st_mtime + STALE_TMP_AGE < time(nullptr))
+				unlinkat(dirfd(dir.get()), name.c_str(), 0);
+			continue;
+		}
+		if (!f(name))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Lists the subdirectories, which the shards are.
+ */
+static
+vector<string> subdirectories(const string &dir_name) {
+	vector<string> res;
+	unique_ptr<DIR, int(*)(DIR *)> dir{opendir(dir_name.c_str()), &closedir};
+	if (!dir)
+		return res;
+	while (dirent *entry = readdir(dir.get())) {
+		string name = entry->d_name;
+		if (name != "." && name != ".." && is_directory(dir.get(), entry))
+			res.push_back(dir_name + name + '/');
+	}
+	return res;
+}
+
+/**
+ * Starts the cache files; the files written before it was introduced are
+ * plain text, which never starts with a zero byte.
+ */
+struct file_header {
+	char magic[8];
+	uint64_t size;     // of the lyrics following the header
+	uint64_t checksum; // fnv1a of the lyrics
+};
+
+constexpr char FILE_MAGIC[8] = {'\0', 'L', 'Y', 'R', 'B', 'A', 'R', '1'};
+
+/**
+ * Maps the file, checking the lyrics against the header if there is one.
+ * A corrupt file is removed, so that the lyrics get fetched again.
+ * @param legacy set to whether the file has no header
+ */
+static
+lyrics_ptr load_file(const string &name, bool *legacy) {
+	*legacy = false;
+	debug_out << "filename = '" << name << "'\n";
+	int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return nullptr;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return nullptr;
+	}
+	// what the old writer left behind when it crashed; even empty lyrics have a header now
+	if (st.st_size == 0) {
+		close(fd);
+		cerr << "lyricbar: the cache file " << name << " is empty, removing it\n";
+		::remove(name.c_str());
+		return nullptr;
+	}
+	size_t size = st.st_size;
+	void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return nullptr;
+
+	const char *text = static_cast<const char *>(map);
+	file_header header;
+	if (size < sizeof(header) || memcmp(text, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0) {
+		*legacy = true;
+		return make_shared<lyrics_text>(map, size, text, size);
+	}
+
+	memcpy(&header, text, sizeof(header));
+	text += sizeof(header);
+	if (header.size != size - sizeof(header) || header.checksum != fnv1a(text, header.size)) {
+		cerr << "lyricbar: the cache file " << name << " is corrupt, removing it\n";
+		munmap(map, size);
+		::remove(name.c_str());
+		return nullptr;
+	}
+	return make_shared<lyrics_text>(map, size, text, header.size);
+}
+
+static
+bool write_all(int fd, const void *buf, size_t size) {
+	auto *p = static_cast<const char *>(buf);
+	while (size > 0) {
+		ssize_t n = write(fd, p, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+enum class fsync_policy { NEVER = 0, FILE = 1, FILE_AND_DIRECTORY = 2 };
+
+static
+void sync_directory(const string &name) {
+	int fd = open(name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (fsync(fd) != 0)
+		cerr << "lyricbar: could not sync " << name << ": " << strerror(errno) << endl;
+	close(fd);
+}
+
+file_backend::file_backend(bool hashed)
+	: hashed(hashed)
+	, migrated(!hashed || access(migrated_marker.c_str(), F_OK) == 0) {}
+
+string file_backend::entry_id(const string &key) {
+	if (!hashed)
+		return key;
+	gchar *hash = g_compute_checksum_for_data(G_CHECKSUM_SHA1, reinterpret_cast<const guchar *>(key.data()), key.size());
+	// the misses stay recognizable
+	string id = (is_miss_key(key) ? MISS_PREFIX : string{}) + hash;
+	g_free(hash);
+	return id;
+}
+
+string file_backend::filename(const string &key) {
+	if (!hashed)
+		return flat_name(key);
+	string id = entry_id(key);
+	size_t hash = id.size() - 40;
+	return hashed_dir + id.substr(hash, 2) + '/' + id.substr(hash + 2, 2) + '/' + id;
+}
+
+/**
+ * The files written before the header was introduced are rewritten with one
+ * the first time they are read, so that they are checked from then on.
+ */
+lyrics_ptr file_backend::load(const string &key) {
+	bool legacy;
+	auto lyrics = load_file(filename(key), &legacy);
+	if (!lyrics && !migrated)
+		lyrics = load_file(flat_name(key), &legacy);
+	if (lyrics && legacy)
+		save(key, string(lyrics->data(), lyrics->size()));
+	return lyrics;
+}
+
+/**
+ * Writes into a temporary file of its own and renames it over the old one,
+ * so that neither concurrent saves nor a crash leave a mix of contents behind,
+ * and the mappings of the old contents stay intact. Whether the data reach
+ * the disk before the rename is up to lyricbar.cache.fsync.
+ */
+bool file_backend::save(const string &key, const string &lyrics) {
+	string name = filename(key);
+	string dir = name.substr(0, name.rfind('/') + 1);
+	if (hashed)
+		mkpath(dir, 0755);
+	// unlike mkstemp, open honours the umask for the permissions
+	static atomic<unsigned> tmp_counter{0};
+	string tmp_name;
+	int fd;
+	do {
+		tmp_name = name + '.' + to_string(getpid()) + '.' + to_string(++tmp_counter) + ".tmp";
+		fd = open(tmp_name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	} while (fd < 0 && errno == EEXIST);
+	if (fd < 0) {
+		cerr << "lyricbar: could not open file for writing: " << tmp_name << endl;
+		return false;
+	}
+
+	auto policy = static_cast<fsync_policy>(deadbeef->conf_get_int("lyricbar.cache.fsync", 1));
+	file_header header;
+	memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+	header.size = lyrics.size();
+	header.checksum = fnv1a(lyrics.data(), lyrics.size());
+	bool written = write_all(fd, &header, sizeof(header))
+	            && write_all(fd, lyrics.data(), lyrics.size())
+	            && (policy == fsync_policy::NEVER || fsync(fd) == 0);
+	written = close(fd) == 0 && written;
+	if (!written) {
+		cerr << "lyricbar: could not write file: " << tmp_name << endl;
+		::remove(tmp_name.c_str());
+		return false;
+	}
+	if (rename(tmp_name.c_str(), name.c_str()) != 0) {
+		cerr << "lyricbar: could not rename " << tmp_name << " to " << name << endl;
+		::remove(tmp_name.c_str());
+		return false;
+	}
+	if (policy == fsync_policy::FILE_AND_DIRECTORY)
+		sync_directory(dir);
+	return true;
+}
+
+bool file_backend::contains(const string &key) {
+	return access(filename(key).c_str(), 0) == 0
+	    || (!migrated && access(flat_name(key).c_str(), 0) == 0);
+}
+
+bool file_backend::remove(const string &key) {
+	bool removed = ::remove(filename(key).c_str()) == 0;
+	if (!migrated)
+		removed = ::remove(flat_name(key).c_str()) == 0 || removed;
+	return removed;
+}
+
+void file_backend::for_each_key(const function<bool(const string &)> &f) {
+	if (!hashed) {
+		for_each_file(lyrics_dir, f);
+		return;
+	}
+	if (!migrated)
+		migrate();
+	if (stopping)
+		return;
+	for (const auto &shard : subdirectories(hashed_dir)) {
+		for (const auto &subshard : subdirectories(shard)) {
+			if (!for_each_file(subshard, f))
+				return;
+		}
+	}
+}
+
+/**
+ * Moves the files of the flat layout into the hashed one, once: a marker
+ * file is left behind when it is done. Until then the flat files are found too.
+ * If the backend is stopped meanwhile, the rest is moved the next time.
+ */
+void file_backend::migrate() {
+	size_t moved = 0;
+	bool finished = for_each_file(lyrics_dir, [this, &moved](const string &key) {
+		// the files of the indexed store
+		if (key == "lyrics.dat" || key == "lyrics.idx")
+			return true;
+		string name = filename(key);
+		mkpath(name.substr(0, name.rfind('/') + 1), 0755);
+		string old_name = flat_name(key);
+		// the newer copy might have been saved in the meantime
+		if (access(name.c_str(), F_OK) == 0)
+			::remove(old_name.c_str());
+		else if (rename(old_name.c_str(), name.c_str()) == 0)
+			++moved;
+		return !stopping;
+	});
+	if (!finished) {
+		cerr << "lyricbar: moved " << moved << " cached lyrics into the hashed layout, "
+		        "the rest is left for later\n";
+		return;
+	}
+	mkpath(hashed_dir, 0755);
+	ofstream{migrated_marker};
+	migrated = true;
+	cerr << "lyricbar: moved " << moved << " cached lyrics into the hashed layout\n";
+}
+
+/**
+ * Answers the membership queries from an in-memory set of the cached keys.
+ * The set is filled by a background scan of the wrapped backend and kept
+ * in sync with the saves and removals; until the scan is over the queries
+ * go to the backend. The remembered misses are in the set too, so that the
+ * UI can tell cheaply whether there is anything to remove for a song.
+ */
+class tracked_backend : public cache_backend {
+public:
+	explicit tracked_backend(shared_ptr<cache_backend> backend);
+	~tracked_backend() override;
+
+	lyrics_ptr load(const string &key) override;
+	bool save(const string &key, const string &lyrics) override;
+	bool contains(const string &key) override;
+	bool remove(const string &key) override;
+	void for_each_key(const function<bool(const string &)> &f) override { backend->for_each_key(f); }
+	string entry_id(const string &key) override { return backend->entry_id(key); }
+	void stop() override { stopping = true; backend->stop(); }
+	/**
+	 * Answers from the memory only, for the UI: while the scan is not over,
+	 * anything might be cached.
+	 */
+	bool might_contain(const string &key);
+
+private:
+	void track(const string &key, bool cached);
+	void load_keys();
+
+	shared_ptr<cache_backend> backend;
+	mutex mtx;
+	// the entry ids of the keys
+	unordered_set<string> keys;
+	unordered_map<string, bool> changed_while_loading;
+	bool ready = false;
+	atomic<bool> stopping{false};
+	thread loader;
+};
+
+tracked_backend::tracked_backend(shared_ptr<cache_backend> backend)
+	: backend(move(backend))
+	, loader(&tracked_backend::load_keys, this) {}
+
+tracked_backend::~tracked_backend() {
+	stopping = true;
+	backend->stop();
+	loader.join();
+}
+
+void tracked_backend::load_keys() {
+	unordered_set<string> found;
+	backend->for_each_key([this, &found](const string &key) {
+		found.insert(key);
+		return !stopping;
+	});
+	if (stopping)
+		return;
+
+	lock_guard<mutex> lock(mtx);
+	keys = move(found);
+	for (const auto &change : changed_while_loading) {
+		if (change.second)
+			keys.insert(change.first);
+		else
+			keys.erase(change.first);
+	}
+	changed_while_loading.clear();
+	ready = true;
+	debug_out << "lyricbar: " << keys.size() << " cache entries found\n";
+}
+
+void tracked_backend::track(const string &key, bool cached) {
+	string id = backend->entry_id(key);
+	lock_guard<mutex> lock(mtx);
+	if (!ready)
+		changed_while_loading[id] = cached;
+	else if (cached)
+		keys.insert(id);
+	else
+		keys.erase(id);
+}
+
+lyrics_ptr tracked_backend::load(const string &key) {
+	auto lyrics = backend->load(key);
+	if (!lyrics)
+		track(key, false); // might have been discarded as corrupt
+	return lyrics;
+}
+
+bool tracked_backend::save(const string &key, const string &lyrics) {
+	bool saved = backend->save(key, lyrics);
+	if (saved)
+		track(key, true);
+	return saved;
+}
+
+bool tracked_backend::contains(const string &key) {
+	string id = backend->entry_id(key);
+	{
+		lock_guard<mutex> lock(mtx);
+		if (ready)
+			return keys.count(id) != 0;
+	}
+	return backend->contains(key);
+}
+
+bool tracked_backend::might_contain(const string &key) {
+	string id = backend->entry_id(key);
+	lock_guard<mutex> lock(mtx);
+	return !ready || keys.count(id) != 0;
+}
+
+bool tracked_backend::remove(const string &key) {
+	bool removed = backend->remove(key);
+	track(key, false);
+	return removed;
+}
+
+lyrics_lru memory_cache;
+
+enum class backend_type { FILES = 0, INDEXED = 1 };
+
+mutex backend_mutex;
+shared_ptr<tracked_backend> backend;
+backend_type current_type;
+bool current_hashed;
+bool current_files;
+
+/**
+ * Returns the disk cache backend chosen in the settings.
+ */
+shared_ptr<tracked_backend> disk_cache() {
+	auto type = static_cast<backend_type>(backend_setting.load());
+	bool hashed = layout_setting == 1;
+	shared_ptr<tracked_backend> replaced;
+	shared_ptr<tracked_backend> current;
+	{
+		lock_guard<mutex> lock(backend_mutex);
+		// the layout only matters to the per-song files
+		if (backend && type == current_type && (!current_files || hashed == current_hashed))
+			return backend;
+
+		current_type = type;
+		current_hashed = hashed;
+		shared_ptr<cache_backend> storage;
+		if (type == backend_type::INDEXED) {
+			auto store = make_shared<indexed_store>(lyrics_dir);
+			if (store->is_open())
+				storage = move(store);
+			else
+				cerr << "lyricbar: falling back to the per-song cache files\n";
+		}
+		current_files = !storage;
+		if (!storage)
+			storage = make_shared<file_backend>(hashed);
+		replaced = move(backend);
+		current = backend = make_shared<tracked_backend>(move(storage));
+	}
+	// the destructor waits for the key scan, which might be rebuilding the index,
+	// while the caller might be the GUI thread
+	if (replaced)
+		lyrics_workers_run([replaced = move(replaced)]() mutable { replaced.reset(); });
+	return current;
+}
+
+} // namespace
+
+static
+string miss_key(const string &provider, const string &artist, const string &title) {
+	return MISS_PREFIX + provider + '.' + cache_key(artist, title);
+}
+
+/**
+ * Returns lyricbar.cache.miss_ttl in seconds; 0 if the misses are not remembered.
+ */
+static
+time_t miss_ttl() {
+	return time_t{max(0, deadbeef->conf_get_int("lyricbar.cache.miss_ttl", 24))} * 3600;
+}
+
+enum class key_mode { EXACT = 0, FOLDED = 1, CANONICAL = 2 };
+
+/**
+ * The key the lyrics were cached under before the keys got normalized.
+ */
+static
+string exact_key(const string &artist, const string &title) {
+	string key = artist + '-' + title;
+	replace(key.begin(), key.end(), '/', '_');
+	return key;
+}
+
+static
+bool starts_with(const string &s, size_t pos, const char *prefix) {
+	return s.compare(pos, strlen(prefix), prefix) == 0;
+}
+
+/**
+ * Cuts the featured artists off: "x feat. y", "x (ft. y) z" and the like.
+ * The titles lose only the unmistakable marks, as "with" and "feat" are
+ * often just words there: "Stay (With Me)", "A Feat of Strength".
+ */
+static
+void strip_featuring(string &s, bool is_artist) {
+	// the marks taken after a space come first, the rest are only taken in brackets
+	static const char *const artist_marks[] = {"feat.", "feat ", "featuring ", "ft.", "ft ", "with "};
+	static const char *const title_marks[] = {"feat.", "ft.", "featuring "};
+	const char *const *marks = is_artist ? artist_marks : title_marks;
+	size_t spaced_count = is_artist ? 5 : 2;
+	size_t bracketed_count = is_artist ? 6 : 3;
+	for (size_t i = 1; i < s.size(); ++i) {
+		char before = s[i - 1];
+		if (before != ' ' && before != '(' && before != '[')
+			continue;
+		size_t marks_count = before == ' ' ? spaced_count : bracketed_count;
+		if (none_of(marks, marks + marks_count, [&](const char *mark) { return starts_with(s, i, mark); }))
+			continue;
+		if (before == ' ') {
+			s.erase(i - 1);
+			return;
+		}
+		size_t close = s.find(before == '(' ? ')' : ']', i);
+		s.erase(i - 1, close == string::npos ? string::npos : close - i + 2);
+		i = 0;
+	}
+}
+
+/**
+ * Collapses the runs of whitespace into single spaces and trims the ends.
+ */
+static
+void collapse_spaces(string &s) {
+	string res;
+	res.reserve(s.size());
+	for (char c : s) {
+		bool space = c == ' ' || c == '\t' || c == '\n' || c == '\r';
+		if (!space)
+			res.push_back(c);
+		else if (!res.empty() && res.back() != ' ')
+			res.push_back(' ');
+	}
+	if (!res.empty() && res.back() == ' ')
+		res.pop_back();
+	s = move(res);
+}
+
+static
+string normalize_part(const string &part, key_mode mode, bool is_artist) {
+	string res;
+	if (all_of(part.begin(), part.end(), [](char c) { return (c & 0x80) == 0; })) {
+		// NFKC leaves ASCII as it is and case folding only lowers it
+		res = part;
+		transform(res.begin(), res.end(), res.begin(), [](char c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; });
+	} else {
+		ustring text{part};
+		if (!text.validate())
+			return part;
+		res = text.normalize(NormalizeMode::NORMALIZE_ALL_COMPOSE).casefold().normalize(NormalizeMode::NORMALIZE_ALL_COMPOSE).raw();
+	}
+	collapse_spaces(res);
+	if (mode != key_mode::CANONICAL)
+		return res;
+
+	strip_featuring(res, is_artist);
+	collapse_spaces(res);
+	if (is_artist) {
+		if (starts_with(res, 0, "the ") && res.size() > 4)
+			res.erase(0, 4);
+		else if (res.size() > 5 && res.compare(res.size() - 5, 5, ", the") == 0)
+			res.erase(res.size() - 5);
+	}
+	return res;
+}
+
+static
+key_mode current_key_mode() {
+	int mode = keys_setting;
+	return static_cast<key_mode>(min(max(mode, 0), int(key_mode::CANONICAL)));
+}
+
+string cache_key(const string &artist, const string &title) {
+	auto mode = current_key_mode();
+	if (mode == key_mode::EXACT)
+		return exact_key(artist, title);
+	return exact_key(normalize_part(artist, mode, true), normalize_part(title, mode, false));
+}
+
+extern "C"
+bool is_cached(const char *artist, const char *title) {
+	if (!artist || !title)
+		return false;
+	string key = cache_key(artist, title);
+	if (disk_cache()->contains(key))
+		return true;
+	string old_key = exact_key(artist, title);
+	return old_key != key && disk_cache()->contains(old_key);
+}
+
+extern "C"
+bool may_be_cached(const char *artist, const char *title) {
+	if (!artist || !title)
+		return false;
+	string key = cache_key(artist, title);
+	if (disk_cache()->might_contain(key))
+		return true;
+	string old_key = exact_key(artist, title);
+	return old_key != key && disk_cache()->might_contain(old_key);
+}
+
+extern "C"
+void reload_cache_settings() {
+	keys_setting = deadbeef->conf_get_int("lyricbar.cache.keys", int(key_mode::CANONICAL));
+	backend_setting = deadbeef->conf_get_int("lyricbar.cache.backend", 0);
+	layout_setting = deadbeef->conf_get_int("lyricbar.cache.layout", 0);
+}
+
+extern "C"
+void ensure_lyrics_path_exists() {
+	reload_cache_settings();
+	mkpath(lyrics_dir, 0755);
+	// start collecting the cached keys right away
+	disk_cache();
+}
+
+lyrics_text::lyrics_text(string text)
+	: owned(move(text))
+	, text(owned.data())
+	, length(owned.size()) {}
+
+lyrics_text::lyrics_text(void *map, size_t map_size, const char *text, size_t size)
+	: map(map)
+	, map_size(map_size)
+	, text(text)
+	, length(size) {}
+
+lyrics_text::~lyrics_text() {
+	if (map)
+		munmap(map, map_size);
+}
+
+/**
+ * Loads the cached lyrics
+ * @param artist The artist name
+ * @param title  The song title
+ * @note         Have no idea about the encodings, so a bug possible here
+ */
+lyrics_ptr load_cached_lyrics(const string &artist, const string &title) {
+	string key = cache_key(artist, title);
+	if (auto lyrics = memory_cache.get(key)) {
+		return lyrics;
+	}
+	auto lyrics = disk_cache()->load(key);
+	if (!lyrics) {
+		// cached before the keys were normalized; moved under the new key on the first hit
+		string old_key = exact_key(artist, title);
+		if (old_key == key || !(lyrics = disk_cache()->load(old_key)))
+			return nullptr;
+		if (disk_cache()->save(key, string(lyrics->data(), lyrics->size()))) {
+			debug_out << "lyricbar: moved the cached lyrics from '" << old_key << "' to '" << key << "'\n";
+			disk_cache()->remove(old_key);
+		}
+	}
+	if (!g_utf8_validate(lyrics->data(), lyrics->size(), nullptr)) {
+		cerr << "lyricbar: cached lyrics for '" << key << "' are not a valid UTF8 string!\n";
+		return nullptr;
+	}
+	memory_cache.put(key, lyrics);
+	return lyrics;
+}
+
+bool save_cached_lyrics(const string &artist, const string &title, const ustring &lyrics) {
+	string key = cache_key(artist, title);
+	memory_cache.put(key, make_shared<lyrics_text>(lyrics.raw()));
+	return disk_cache()->save(key, lyrics);
+}
+
+bool remove_cached_lyrics(const string &artist, const string &title) {
+	string key = cache_key(artist, title);
+	memory_cache.erase(key);
+	bool removed = disk_cache()->remove(key);
+	string old_key = exact_key(artist, title);
+	if (old_key != key)
+		removed = disk_cache()->remove(old_key) || removed;
+	return removed;
+}
+
+bool save_cached_miss(const string &provider, const string &artist, const string &title) {
+	if (miss_ttl() == 0)
+		return false;
+	// the time of the miss, so that a changed TTL applies to it
+	return disk_cache()->save(miss_key(provider, artist, title), to_string(time(nullptr)));
+}
+
+bool is_cached_miss(const string &provider, const string &artist, const string &title) {
+	time_t ttl = miss_ttl();
+	if (ttl == 0)
+		return false;
+	string key = miss_key(provider, artist, title);
+	auto entry = disk_cache()->load(key);
+	if (!entry)
+		return false;
+	time_t missed_at = strtoll(string(entry->data(), entry->size()).c_str(), nullptr, 10);
+	if (time(nullptr) - missed_at < ttl)
+		return true;
+	disk_cache()->remove(key);
+	return false;
+}
+
+bool may_have_cached_miss(const string &provider, const string &artist, const string &title) {
+	return disk_cache()->might_contain(miss_key(provider, artist, title));
+}
+
+bool remove_cached_miss(const string &provider, const string &artist, const string &title) {
+	return disk_cache()->remove(miss_key(provider, artist, title));
+}
+
+cache_stats get_cache_stats() {
+	return memory_cache.stats();
+}
@@ -0,0 +1,117 @@
+#pragma once
+#ifndef LYRICBAR_CACHE_H
+#define LYRICBAR_CACHE_H
+
+#ifndef __cplusplus
+#include <stdbool.h>
+#else
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#include <glibmm/ustring.h>
+
+/**
+ * Read-only lyrics text, either owned or mapped straight from the cache.
+ */
+class lyrics_text {
+public:
+	explicit lyrics_text(std::string text);
+	/**
+	 * Takes the ownership of the mapping; the text lies somewhere inside it.
+	 */
+	lyrics_text(void *map, size_t map_size, const char *text, size_t size);
+	~lyrics_text();
+
+	lyrics_text(const lyrics_text &) = delete;
+	lyrics_text &operator=(const lyrics_text &) = delete;
+
+	const char *data() const { return text; }
+	size_t size() const { return length; }
+
+private:
+	std::string owned;
+	void *map = nullptr;
+	size_t map_size = 0;
+	const char *text;
+	size_t length;
+};
+
+using lyrics_ptr = std::shared_ptr<const lyrics_text>;
+
+struct cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t entries;
+	size_t bytes;
+};
+
+/**
+ * Builds the key the lyrics of the song are cached under. Unless
+ * lyricbar.cache.keys is 0, the artist and the title are case-folded and
+ * NFKC-normalized with the whitespace collapsed; with 2 (the default),
+ * the featured artists and the leading article of the artist are dropped too.
+ * The lyrics cached under the exact names are still found.
+ */
+std::string cache_key(const std::string &artist, const std::string &title);
+
+/**
+ * Loads the cached lyrics.
+ * @return nullptr if there are none
+ */
+lyrics_ptr load_cached_lyrics(const std::string &artist, const std::string &title);
+
+bool save_cached_lyrics(const std::string &artist, const std::string &title, const Glib::ustring &lyrics);
+
+/**
+ * Drops the lyrics from both the memory and the disk caches.
+ * @return true if the lyrics were removed from the disk
+ */
+bool remove_cached_lyrics(const std::string &artist, const std::string &title);
+
+/**
+ * Remembers that the provider has no lyrics for the song.
+ * Does nothing if lyricbar.cache.miss_ttl is 0.
+ */
+bool save_cached_miss(const std::string &provider, const std::string &artist, const std::string &title);
+
+/**
+ * Tells whether the provider has had no lyrics for the song
+ * within the last lyricbar.cache.miss_ttl hours.
+ */
+bool is_cached_miss(const std::string &provider, const std::string &artist, const std::string &title);
+
+/**
+ * Tells whether a miss might be remembered for the song without touching
+ * the disk, like may_be_cached; the expired ones count too.
+ */
+bool may_have_cached_miss(const std::string &provider, const std::string &artist, const std::string &title);
+
+bool remove_cached_miss(const std::string &provider, const std::string &artist, const std::string &title);
+
+/**
+ * Returns the counters of the in-memory cache.
+ */
+cache_stats get_cache_stats();
+
+extern "C" {
+#endif // __cplusplus
+
+bool is_cached(const char *artist, const char *title);
+
+/**
+ * Tells whether the lyrics might be cached without touching the disk, so it
+ * never blocks; until the cached keys are collected, it answers true.
+ */
+bool may_be_cached(const char *artist, const char *title);
+
+/**
+ * Rereads the settings of the cache; they are not looked up on every use.
+ */
+void reload_cache_settings();
+void ensure_lyrics_path_exists();
+
+#ifdef __cplusplus
+}
+#endif
+#endif // LYRICBAR_CACHE_H
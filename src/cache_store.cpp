@@ -0,0 +1,622 @@
+#include "cache_store.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <iostream>
+#include <vector>
+
+#include "debug.h"
+
+using namespace std;
+
+uint64_t fnv1a(const char *data, size_t size, uint64_t hash) {
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= static_cast<unsigned char>(data[i]);
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+namespace {
+
+constexpr char DATA_MAGIC[8] = {'L', 'Y', 'R', 'B', 'D', 'A', 'T', '1'};
+constexpr uint32_t INDEX_MAGIC    = 0x4c594958; // "LYIX"
+constexpr uint32_t INDEX_VERSION  = 1;
+constexpr uint32_t RECORD_LYRICS  = 0x4c59524c; // "LYRL"
+constexpr uint32_t RECORD_REMOVED = 0x4c595244; // "LYRD"
+
+constexpr uint64_t SLOT_EMPTY   = 0; // offset 0 is taken by the data file magic
+constexpr uint64_t SLOT_REMOVED = ~uint64_t{0};
+
+constexpr uint64_t MIN_CAPACITY = 1024;
+constexpr uint64_t COMPACTION_THRESHOLD = uint64_t{1} << 20U;
+
+uint64_t key_hash(const string &key) {
+	return fnv1a(key.data(), key.size());
+}
+
+uint32_t record_checksum(const string &key, const char *data, size_t size) {
+	uint64_t hash = fnv1a(data, size, fnv1a(key.data(), key.size()));
+	return static_cast<uint32_t>(hash ^ (hash >> 32U));
+}
+
+uint32_t record_checksum(const string &key, const string &data) {
+	return record_checksum(key, data.data(), data.size());
+}
+
+bool pread_all(int fd, void *buf, size_t size, uint64_t offset) {
+	auto *p = static_cast<char *>(buf);
+	while (size > 0) {
+		ssize_t n = pread(fd, p, size, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+bool pwrite_all(int fd, const void *buf, size_t size, uint64_t offset) {
+	auto *p = static_cast<const char *>(buf);
+	while (size > 0) {
+		ssize_t n = pwrite(fd, p, size, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+} // namespace
+
+struct indexed_store::index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t capacity;   // number of slots, a power of 2
+	uint64_t used;       // slots pointing to live records
+	uint64_t removed;    // tombstone slots
+	uint64_t data_size;  // size of the data file the index describes
+	uint64_t dead_bytes; // bytes taken by the records nobody points to
+};
+
+struct indexed_store::slot {
+	uint64_t hash;
+	uint64_t offset;
+};
+
+struct indexed_store::record_header {
+	uint32_t magic;
+	uint32_t key_size;
+	uint32_t data_size;
+	uint32_t checksum;
+};
+
+indexed_store::indexed_store(string dir)
+	: data_path(dir + "lyrics.dat")
+	, index_path(dir + "lyrics.idx") {
+	if (!open_files()) {
+		cerr << "lyricbar: could not open the lyrics store in " << dir << ": " << strerror(errno) << endl;
+		close_files();
+	}
+}
+
+indexed_store::~indexed_store() {
+	close_files();
+}
+
+bool indexed_store::open_files() {
+	data_fd = open(data_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	index_fd = open(index_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (data_fd < 0 || index_fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(data_fd, &st) != 0)
+		return false;
+	uint64_t data_size = st.st_size;
+	if (data_size == 0) {
+		if (!pwrite_all(data_fd, DATA_MAGIC, sizeof(DATA_MAGIC), 0))
+			return false;
+		data_size = sizeof(DATA_MAGIC);
+	} else {
+		char magic[sizeof(DATA_MAGIC)];
+		if (!pread_all(data_fd, magic, sizeof(magic), 0) || memcmp(magic, DATA_MAGIC, sizeof(magic)) != 0) {
+			errno = EINVAL;
+			return false;
+		}
+	}
+
+	if (fstat(index_fd, &st) != 0)
+		return false;
+	if (size_t(st.st_size) >= sizeof(index_header)) {
+		map_size = st.st_size;
+		void *p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+		if (p == MAP_FAILED) {
+			map_size = 0;
+			return false;
+		}
+		header = static_cast<index_header *>(p);
+		slots = reinterpret_cast<slot *>(header + 1);
+		uint64_t cap = header->capacity;
+		if (header->magic == INDEX_MAGIC && header->version == INDEX_VERSION
+		        && cap >= MIN_CAPACITY && (cap & (cap - 1)) == 0
+		        && map_size == sizeof(index_header) + cap * sizeof(slot)
+		        && header->data_size == data_size) {
+			return true;
+		}
+		munmap(header, map_size);
+		header = nullptr;
+		slots = nullptr;
+		map_size = 0;
+	}
+	// the index is missing, stale or broken; rebuilding it takes a scan of
+	// the whole data file, so it's left for the first use, off the main thread
+	index_stale = true;
+	return true;
+}
+
+/**
+ * Rebuilds the index if it has been found stale.
+ * @return false if the store is unusable
+ */
+bool indexed_store::ensure_index() {
+	if (index_stale) {
+		index_stale = false;
+		debug_out << "lyricbar: rebuilding the lyrics index\n";
+		if (!rebuild_index()) {
+			cerr << "lyricbar: could not rebuild the lyrics index: " << strerror(errno) << endl;
+			close_files();
+		}
+	}
+	return header != nullptr;
+}
+
+void indexed_store::close_files() {
+	if (header) {
+		munmap(header, map_size);
+		header = nullptr;
+		slots = nullptr;
+		map_size = 0;
+	}
+	if (data_fd >= 0) {
+		close(data_fd);
+		data_fd = -1;
+	}
+	if (index_fd >= 0) {
+		close(index_fd);
+		index_fd = -1;
+	}
+}
+
+/**
+ * Replaces the index with an empty one.
+ * The data file bookkeeping in the header is preserved.
+ */
+bool indexed_store::map_index(uint64_t capacity) {
+	index_header saved{};
+	if (header) {
+		saved = *header;
+		munmap(header, map_size);
+		header = nullptr;
+		slots = nullptr;
+	}
+	map_size = sizeof(index_header) + capacity * sizeof(slot);
+	if (ftruncate(index_fd, 0) != 0 || ftruncate(index_fd, map_size) != 0)
+		return false;
+	void *p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+	if (p == MAP_FAILED) {
+		map_size = 0;
+		return false;
+	}
+	header = static_cast<index_header *>(p);
+	slots = reinterpret_cast<slot *>(header + 1);
+	header->magic = INDEX_MAGIC;
+	header->version = INDEX_VERSION;
+	header->capacity = capacity;
+	header->used = 0;
+	header->removed = 0;
+	header->data_size = saved.data_size;
+	header->dead_bytes = saved.dead_bytes;
+	return true;
+}
+
+void indexed_store::rehash(uint64_t capacity) {
+	vector<slot> live;
+	live.reserve(header->used);
+	for (uint64_t i = 0; i < header->capacity; ++i) {
+		if (slots[i].offset != SLOT_EMPTY && slots[i].offset != SLOT_REMOVED)
+			live.push_back(slots[i]);
+	}
+	if (!map_index(capacity)) {
+		cerr << "lyricbar: could not resize the lyrics index: " << strerror(errno) << endl;
+		close_files();
+		return;
+	}
+	for (const auto &s : live)
+		insert(s.hash, s.offset);
+}
+
+/**
+ * Recreates the index from the data file. A broken record in the middle is
+ * skipped up to the next intact one and counted as dead bytes; a torn record
+ * at the end of the file (e.g. after a crash) is cut off.
+ */
+bool indexed_store::rebuild_index() {
+	struct stat st;
+	if (fstat(data_fd, &st) != 0)
+		return false;
+	uint64_t file_size = st.st_size;
+
+	if (!map_index(MIN_CAPACITY))
+		return false;
+	header->data_size = sizeof(DATA_MAGIC);
+	header->dead_bytes = 0;
+
+	uint64_t offset = sizeof(DATA_MAGIC);
+	record_header rec;
+	string key;
+	while (offset < file_size) {
+		if (!read_record(offset, file_size, rec, &key, nullptr)) {
+			uint64_t next = next_record(offset + 1, file_size);
+			if (next == file_size)
+				break;
+			cerr << "lyricbar: skipping " << next - offset << " broken bytes in the lyrics store\n";
+			header->dead_bytes += next - offset;
+			offset = next;
+			continue;
+		}
+		uint64_t size = sizeof(rec) + rec.key_size + rec.data_size;
+		header->data_size = offset + size;
+		if (rec.magic == RECORD_LYRICS) {
+			put(key, offset);
+		} else {
+			erase(key);
+			header->dead_bytes += size;
+		}
+		if (!header)
+			return false;
+		offset += size;
+	}
+	if (offset != file_size) {
+		cerr << "lyricbar: dropping " << file_size - offset << " broken bytes from the lyrics store\n";
+		if (ftruncate(data_fd, offset) != 0)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Looks for the first intact record starting at the offset or after it.
+ * @return the offset of the record; end if there is none
+ */
+uint64_t indexed_store::next_record(uint64_t offset, uint64_t end) const {
+	constexpr size_t CHUNK_SIZE = 64 << 10;
+	string buf;
+	record_header rec;
+	while (offset + sizeof(rec) <= end) {
+		buf.resize(min<uint64_t>(CHUNK_SIZE, end - offset));
+		if (!pread_all(data_fd, &buf[0], buf.size(), offset))
+			return end;
+		for (size_t i = 0; i + sizeof(rec.magic) <= buf.size(); ++i) {
+			uint32_t magic;
+			memcpy(&magic, &buf[i], sizeof(magic));
+			if ((magic == RECORD_LYRICS || magic == RECORD_REMOVED)
+			        && read_record(offset + i, end, rec, nullptr, nullptr))
+				return offset + i;
+		}
+		// a magic might be split between the chunks
+		offset += buf.size() - (sizeof(rec.magic) - 1);
+	}
+	return end;
+}
+
+/**
+ * Reads the record at the offset, verifying its integrity.
+ * @param end the offset the record must end before
+ */
+bool indexed_store::read_record(uint64_t offset, uint64_t end, record_header &rec, string *key, string *data) const {
+	if (offset + sizeof(rec) > end || !pread_all(data_fd, &rec, sizeof(rec), offset))
+		return false;
+	if ((rec.magic != RECORD_LYRICS && rec.magic != RECORD_REMOVED)
+	        || offset + sizeof(rec) + rec.key_size + rec.data_size > end)
+		return false;
+
+	string k(rec.key_size, '\0');
+	string d(rec.data_size, '\0');
+	if (!pread_all(data_fd, &k[0], k.size(), offset + sizeof(rec))
+	        || !pread_all(data_fd, &d[0], d.size(), offset + sizeof(rec) + k.size())
+	        || record_checksum(k, d) != rec.checksum)
+		return false;
+	if (key)
+		*key = move(k);
+	if (data)
+		*data = move(d);
+	return true;
+}
+
+uint64_t indexed_store::record_size(uint64_t offset) const {
+	record_header rec;
+	if (!pread_all(data_fd, &rec, sizeof(rec), offset))
+		return 0;
+	return sizeof(rec) + rec.key_size + rec.data_size;
+}
+
+/**
+ * Writes the record at the end of the data file. The caller counts it into
+ * data_size only after updating the slot, so that a crash in between leaves
+ * the index stale, which gets noticed, rather than missing the record.
+ */
+bool indexed_store::append_record(uint32_t magic, const string &key, const string &data,
+                                  uint64_t &offset, uint64_t &size) {
+	record_header rec{magic, static_cast<uint32_t>(key.size()), static_cast<uint32_t>(data.size()),
+	                  record_checksum(key, data)};
+	string buf;
+	buf.reserve(sizeof(rec) + key.size() + data.size());
+	buf.append(reinterpret_cast<const char *>(&rec), sizeof(rec));
+	buf += key;
+	buf += data;
+
+	offset = header->data_size;
+	if (!pwrite_all(data_fd, buf.data(), buf.size(), offset)) {
+		cerr << "lyricbar: could not write to the lyrics store: " << strerror(errno) << endl;
+		if (ftruncate(data_fd, offset) != 0) {
+			// the broken tail will be cut off by the next rebuild
+		}
+		return false;
+	}
+	size = buf.size();
+	return true;
+}
+
+/**
+ * Looks up the slot pointing to the key's lyrics.
+ */
+indexed_store::slot *indexed_store::find(const string &key, uint64_t hash) {
+	uint64_t mask = header->capacity - 1;
+	for (uint64_t i = hash & mask, n = 0; n < header->capacity; i = (i + 1) & mask, ++n) {
+		slot &s = slots[i];
+		if (s.offset == SLOT_EMPTY)
+			return nullptr;
+		if (s.offset == SLOT_REMOVED || s.hash != hash)
+			continue;
+		record_header rec;
+		string stored_key;
+		if (pread_all(data_fd, &rec, sizeof(rec), s.offset) && rec.key_size == key.size()) {
+			stored_key.resize(rec.key_size);
+			if (pread_all(data_fd, &stored_key[0], stored_key.size(), s.offset + sizeof(rec))
+			        && stored_key == key) {
+				return &s;
+			}
+		}
+	}
+	return nullptr;
+}
+
+void indexed_store::insert(uint64_t hash, uint64_t offset) {
+	uint64_t mask = header->capacity - 1;
+	for (uint64_t i = hash & mask;; i = (i + 1) & mask) {
+		slot &s = slots[i];
+		if (s.offset == SLOT_EMPTY || s.offset == SLOT_REMOVED) {
+			if (s.offset == SLOT_REMOVED)
+				--header->removed;
+			s.hash = hash;
+			s.offset = offset;
+			++header->used;
+			return;
+		}
+	}
+}
+
+void indexed_store::put(const string &key, uint64_t offset) {
+	uint64_t hash = key_hash(key);
+	if (slot *s = find(key, hash)) {
+		header->dead_bytes += record_size(s->offset);
+		s->offset = offset;
+		return;
+	}
+	// keep the load factor under 3/4
+	if ((header->used + header->removed + 1) * 4 > header->capacity * 3) {
+		rehash(header->used * 2 >= header->capacity ? header->capacity * 2 : header->capacity);
+		if (!header)
+			return;
+	}
+	insert(hash, offset);
+}
+
+void indexed_store::erase(const string &key) {
+	if (slot *s = find(key, key_hash(key))) {
+		header->dead_bytes += record_size(s->offset);
+		s->offset = SLOT_REMOVED;
+		--header->used;
+		++header->removed;
+	}
+}
+
+lyrics_ptr indexed_store::load(const string &key) {
+	lock_guard<mutex> lock(mtx);
+	if (!ensure_index())
+		return nullptr;
+	slot *s = find(key, key_hash(key));
+	if (!s)
+		return nullptr;
+	record_header rec;
+	if (!pread_all(data_fd, &rec, sizeof(rec), s->offset))
+		return nullptr;
+	uint64_t text_offset = s->offset + sizeof(rec) + rec.key_size;
+	if (text_offset + rec.data_size > header->data_size)
+		return nullptr;
+	if (rec.data_size == 0)
+		return make_shared<lyrics_text>(string{});
+
+	// mmap wants the offset aligned to the page size
+	uint64_t map_offset = text_offset & ~uint64_t(sysconf(_SC_PAGESIZE) - 1);
+	size_t map_size = text_offset - map_offset + rec.data_size;
+	void *map = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, data_fd, map_offset);
+	if (map == MAP_FAILED)
+		return nullptr;
+	// the records are never overwritten and compaction replaces the whole file,
+	// so the mapping stays valid as long as it's needed
+	auto lyrics = make_shared<lyrics_text>(map, map_size, static_cast<const char *>(map) + (text_offset - map_offset),
+	                                       rec.data_size);
+	if (record_checksum(key, lyrics->data(), lyrics->size()) != rec.checksum) {
+		cerr << "lyricbar: the lyrics store record for '" << key << "' is corrupt\n";
+		return nullptr;
+	}
+	return lyrics;
+}
+
+bool indexed_store::save(const string &key, const string &lyrics) {
+	lock_guard<mutex> lock(mtx);
+	if (!ensure_index())
+		return false;
+	uint64_t offset;
+	uint64_t size;
+	if (!append_record(RECORD_LYRICS, key, lyrics, offset, size))
+		return false;
+	put(key, offset);
+	if (!header)
+		return false;
+	header->data_size = offset + size;
+	maybe_compact();
+	return header != nullptr;
+}
+
+bool indexed_store::contains(const string &key) {
+	lock_guard<mutex> lock(mtx);
+	return ensure_index() && find(key, key_hash(key));
+}
+
+bool indexed_store::remove(const string &key) {
+	lock_guard<mutex> lock(mtx);
+	if (!ensure_index() || !find(key, key_hash(key)))
+		return false;
+	uint64_t offset;
+	uint64_t size;
+	if (!append_record(RECORD_REMOVED, key, {}, offset, size))
+		return false;
+	erase(key);
+	header->data_size = offset + size;
+	header->dead_bytes += size;
+	maybe_compact();
+	return true;
+}
+
+/**
+ * Lists the keys in batches, taking the lock for one batch at a time, so
+ * that the loads and saves are not held up by the scan. The records the
+ * snapshot points to are never overwritten, only compaction moves them;
+ * then the listing starts over with a fresh snapshot.
+ */
+void indexed_store::for_each_key(const function<bool(const string &)> &f) {
+	constexpr size_t BATCH_SIZE = 256;
+	vector<uint64_t> offsets;
+	uint64_t snapshot_compactions = 0;
+	vector<string> batch;
+	record_header rec;
+	for (size_t next = 0;; next += BATCH_SIZE) {
+		batch.clear();
+		{
+			lock_guard<mutex> lock(mtx);
+			if (!ensure_index())
+				return;
+			if (next == 0 || compactions != snapshot_compactions) {
+				offsets.clear();
+				for (uint64_t i = 0; i < header->capacity; ++i) {
+					if (slots[i].offset != SLOT_EMPTY && slots[i].offset != SLOT_REMOVED)
+						offsets.push_back(slots[i].offset);
+				}
+				snapshot_compactions = compactions;
+				next = 0;
+			}
+			if (next >= offsets.size())
+				return;
+			for (size_t i = next; i < min(next + BATCH_SIZE, offsets.size()); ++i) {
+				string key;
+				if (!pread_all(data_fd, &rec, sizeof(rec), offsets[i]))
+					continue;
+				key.resize(rec.key_size);
+				if (pread_all(data_fd, &key[0], key.size(), offsets[i] + sizeof(rec)))
+					batch.push_back(move(key));
+			}
+		}
+		for (const auto &key : batch) {
+			if (!f(key))
+				return;
+		}
+	}
+}
+
+void indexed_store::maybe_compact() {
+	if (!header)
+		return;
+	uint64_t live_bytes = header->data_size - sizeof(DATA_MAGIC) - header->dead_bytes;
+	if (header->dead_bytes > COMPACTION_THRESHOLD && header->dead_bytes > live_bytes)
+		compact();
+}
+
+/**
+ * Rewrites the data file leaving only the live records.
+ */
+void indexed_store::compact() {
+	debug_out << "lyricbar: compacting the lyrics store\n";
+	string tmp_path = data_path + ".tmp";
+	int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		cerr << "lyricbar: could not compact the lyrics store: " << strerror(errno) << endl;
+		return;
+	}
+
+	vector<slot> live;
+	live.reserve(header->used);
+	uint64_t new_size = sizeof(DATA_MAGIC);
+	bool ok = pwrite_all(fd, DATA_MAGIC, sizeof(DATA_MAGIC), 0);
+	string buf;
+	for (uint64_t i = 0; ok && i < header->capacity; ++i) {
+		const slot &s = slots[i];
+		if (s.offset == SLOT_EMPTY || s.offset == SLOT_REMOVED)
+			continue;
+		uint64_t size = record_size(s.offset);
+		buf.resize(size);
+		ok = size > 0 && pread_all(data_fd, &buf[0], size, s.offset)
+		     && pwrite_all(fd, buf.data(), size, new_size);
+		live.push_back({s.hash, new_size});
+		new_size += size;
+	}
+	ok = ok && fsync(fd) == 0 && rename(tmp_path.c_str(), data_path.c_str()) == 0;
+	if (!ok) {
+		cerr << "lyricbar: could not compact the lyrics store: " << strerror(errno) << endl;
+		close(fd);
+		unlink(tmp_path.c_str());
+		return;
+	}
+
+	close(data_fd);
+	data_fd = fd;
+	++compactions;
+	header->data_size = new_size;
+	header->dead_bytes = 0;
+	uint64_t capacity = MIN_CAPACITY;
+	while (live.size() * 2 > capacity)
+		capacity *= 2;
+	if (!map_index(capacity)) {
+		cerr << "lyricbar: could not rebuild the lyrics index: " << strerror(errno) << endl;
+		close_files();
+		return;
+	}
+	for (const auto &s : live)
+		insert(s.hash, s.offset);
+}
@@ -0,0 +1,108 @@
+#pragma once
+#ifndef LYRICBAR_CACHE_STORE_H
+#define LYRICBAR_CACHE_STORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include "cache.h"
+
+/**
+ * The 64-bit FNV-1a hash of the data, continuing from the given hash.
+ */
+uint64_t fnv1a(const char *data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL);
+
+/**
+ * The storage the cached lyrics live in.
+ */
+class cache_backend {
+public:
+	virtual ~cache_backend() = default;
+
+	/**
+	 * @return the lyrics, mapped from the disk if possible; nullptr if not cached
+	 */
+	virtual lyrics_ptr load(const std::string &key) = 0;
+	virtual bool save(const std::string &key, const std::string &lyrics) = 0;
+	virtual bool contains(const std::string &key) = 0;
+	virtual bool remove(const std::string &key) = 0;
+	/**
+	 * Calls the function with the entry_id of every cached key until it returns false.
+	 */
+	virtual void for_each_key(const std::function<bool(const std::string &)> &f) = 0;
+	/**
+	 * Returns what the key is stored under, if the backend can't list the keys themselves.
+	 */
+	virtual std::string entry_id(const std::string &key) { return key; }
+	/**
+	 * Asks the long operations, like listing the keys, to give up early,
+	 * as the backend is about to be destroyed.
+	 */
+	virtual void stop() {}
+};
+
+/**
+ * Keeps all the lyrics in a single append-only data file and finds them
+ * through a memory-mapped open addressing hash index stored next to it.
+ * Removals are appended as markers, so the index can always be rebuilt by
+ * scanning the data file; the space taken by stale records is reclaimed
+ * by compaction.
+ */
+class indexed_store : public cache_backend {
+public:
+	explicit indexed_store(std::string dir);
+	~indexed_store() override;
+
+	indexed_store(const indexed_store &) = delete;
+	indexed_store &operator=(const indexed_store &) = delete;
+
+	/**
+	 * @return false if the store files could not be opened
+	 */
+	bool is_open() const { return data_fd >= 0; }
+
+	lyrics_ptr load(const std::string &key) override;
+	bool save(const std::string &key, const std::string &lyrics) override;
+	bool contains(const std::string &key) override;
+	bool remove(const std::string &key) override;
+	void for_each_key(const std::function<bool(const std::string &)> &f) override;
+
+private:
+	struct index_header;
+	struct slot;
+	struct record_header;
+
+	bool open_files();
+	void close_files();
+	bool map_index(uint64_t capacity);
+	void rehash(uint64_t capacity);
+	bool ensure_index();
+	bool rebuild_index();
+	uint64_t next_record(uint64_t offset, uint64_t end) const;
+	bool read_record(uint64_t offset, uint64_t end, record_header &rec, std::string *key, std::string *data) const;
+	uint64_t record_size(uint64_t offset) const;
+	bool append_record(uint32_t magic, const std::string &key, const std::string &data,
+	                   uint64_t &offset, uint64_t &size);
+	slot *find(const std::string &key, uint64_t hash);
+	void insert(uint64_t hash, uint64_t offset);
+	void put(const std::string &key, uint64_t offset);
+	void erase(const std::string &key);
+	void maybe_compact();
+	void compact();
+
+	std::mutex mtx;
+	const std::string data_path;
+	const std::string index_path;
+	int data_fd = -1;
+	int index_fd = -1;
+	index_header *header = nullptr;
+	slot *slots = nullptr;
+	size_t map_size = 0;
+	bool index_stale = false;
+	uint64_t compactions = 0; // lets the listing of the keys notice the moved records
+};
+
+#endif // LYRICBAR_CACHE_STORE_H
@@ -0,0 +1,195 @@
+#include "http.h"
+
+#include <curl/curl.h>
+
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+#include "main.h"
+#include "workers.h"
+
+using namespace std;
+
+constexpr size_t MAX_DOCUMENT_SIZE = size_t{1} << 20U; // 1MB outta be enough
+
+namespace {
+
+/**
+ * The connection pool, DNS cache and TLS sessions shared by the easy handles of all threads.
+ */
+class http_share {
+public:
+	http_share() {
+		share = curl_share_init();
+		curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock);
+		curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock);
+		curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	}
+
+	~http_share() {
+		curl_share_cleanup(share);
+	}
+
+	CURLSH *get() const {
+		return share;
+	}
+
+private:
+	CURLSH *share;
+	array<mutex, CURL_LOCK_DATA_LAST> mutexes;
+
+	static void lock(CURL *, curl_lock_data data, curl_lock_access, void *self) {
+		static_cast<http_share *>(self)->mutexes[data].lock();
+	}
+
+	static void unlock(CURL *, curl_lock_data data, void *self) {
+		static_cast<http_share *>(self)->mutexes[data].unlock();
+	}
+};
+
+/**
+ * The easy handle of a thread; it keeps the share alive until it is cleaned up.
+ */
+struct thread_client {
+	shared_ptr<http_share> share;
+	CURL *curl = nullptr;
+
+	~thread_client() {
+		if (curl)
+			curl_easy_cleanup(curl);
+	}
+};
+
+} // namespace
+
+// whether http_init has succeeded, so that http_cleanup can be paired with it
+static bool curl_initialized = false;
+static mutex share_mutex;
+static shared_ptr<http_share> current_share;
+static thread_local thread_client client;
+
+static
+CURL *get_handle() {
+	shared_ptr<http_share> share;
+	{
+		lock_guard<mutex> lock(share_mutex);
+		if (!current_share)
+			current_share = make_shared<http_share>();
+		share = current_share;
+	}
+	if (client.share != share) {
+		if (client.curl)
+			curl_easy_cleanup(client.curl);
+		client.curl = curl_easy_init();
+		client.share = move(share);
+		if (client.curl)
+			curl_easy_setopt(client.curl, CURLOPT_SHARE, client.share->get());
+	}
+	return client.curl;
+}
+
+namespace {
+
+struct transfer {
+	CURL *curl;
+	const http_consumer &consume;
+	size_t received;
+	bool rejected; // an error response came
+	bool too_large;
+	bool stopped;  // by the consumer
+};
+
+} // namespace
+
+static
+size_t on_data(char *data, size_t size, size_t count, void *userdata) {
+	auto &t = *static_cast<transfer *>(userdata);
+	size_t bytes = size * count;
+	long status = 0;
+	curl_easy_getinfo(t.curl, CURLINFO_RESPONSE_CODE, &status);
+	if (status / 100 != 2) {
+		t.rejected = true;
+		return 0;
+	}
+	if (t.received + bytes > MAX_DOCUMENT_SIZE) {
+		t.too_large = true;
+		return 0;
+	}
+	t.received += bytes;
+	if (!t.consume(data, bytes)) {
+		t.stopped = true;
+		return 0;
+	}
+	return bytes;
+}
+
+static
+int on_progress(void *, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+	return job_cancelled() ? 1 : 0;
+}
+
+bool http_get(const string &url, const http_consumer &consume) {
+	CURL *curl = get_handle();
+	if (!curl)
+		return false;
+
+	transfer t{curl, consume, 0, false, false, false};
+	// the connections and the share survive the reset
+	curl_easy_reset(curl);
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, "deadbeef-lyricbar");
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5L);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	// all the encodings curl was built with
+	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS,
+	                 long(max(1, deadbeef->conf_get_int("lyricbar.http.connect_timeout", 5000))));
+	// the transfer is stalled if less than a byte per second comes for that long
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME,
+	                 long(max(1, deadbeef->conf_get_int("lyricbar.http.read_timeout", 10))));
+	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+	curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, on_progress);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, on_data);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &t);
+
+	CURLcode res = curl_easy_perform(curl);
+	if (t.stopped)
+		return true;
+	if (res != CURLE_OK) {
+		if (t.too_large)
+			cerr << "lyricbar: document '" << url << "' too large!\n";
+		else if (res != CURLE_ABORTED_BY_CALLBACK && !t.rejected)
+			cerr << "lyricbar: couldn't download '" << url << "': " << curl_easy_strerror(res) << '\n';
+		return false;
+	}
+	long status = 0;
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+	return status / 100 == 2;
+}
+
+void http_init() {
+	CURLcode res = curl_global_init(CURL_GLOBAL_DEFAULT);
+	if (res != CURLE_OK)
+		cerr << "lyricbar: couldn't initialize libcurl: " << curl_easy_strerror(res) << '\n';
+	curl_initialized = res == CURLE_OK;
+}
+
+void http_cleanup() {
+	{
+		lock_guard<mutex> lock(share_mutex);
+		current_share.reset();
+	}
+	// the calls are counted by libcurl, so the other users of it are not affected
+	if (curl_initialized)
+		curl_global_cleanup();
+	curl_initialized = false;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#ifndef LYRICBAR_HTTP_H
+#define LYRICBAR_HTTP_H
+
+#ifdef __cplusplus
+#include <functional>
+#include <string>
+
+/**
+ * Takes the next piece of the response body.
+ * @return false to stop the transfer
+ */
+using http_consumer = std::function<bool(const char *data, size_t size)>;
+
+/**
+ * Downloads the document, passing the body of a successful (2xx) response on
+ * as it arrives. The connection kept alive since an earlier request to the
+ * same host is reused. Compressed responses are accepted; the transfer is
+ * abandoned if the job is cancelled or the connection or the reading takes
+ * longer than lyricbar.http.connect_timeout and lyricbar.http.read_timeout.
+ * @return true if the whole body has been passed or the consumer has stopped
+ *         the transfer
+ */
+bool http_get(const std::string &url, const http_consumer &consume);
+
+extern "C" {
+#endif
+
+/**
+ * Initializes libcurl, which is not thread-safe; to be called on the main
+ * thread before any request.
+ */
+void http_init();
+
+/**
+ * Closes the kept connections and releases libcurl. The workers must be
+ * stopped already, so that no thread holds a connection anymore.
+ */
+void http_cleanup();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LYRICBAR_HTTP_H
@@ -0,0 +1,123 @@
+#include "lrc.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+namespace {
+
+struct timed_line {
+	double time;
+	const char *text;
+	size_t size;
+};
+
+} // namespace
+
+static
+bool is_digit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+/**
+ * Parses the contents of a time tag: mm:ss, mm:ss.xx or mm:ss:xx.
+ */
+static
+bool parse_time(const char *tag, const char *tag_end, double &time) {
+	const char *p = tag;
+	unsigned long minutes = 0;
+	if (p == tag_end || !is_digit(*p))
+		return false;
+	while (p < tag_end && is_digit(*p))
+		minutes = minutes * 10 + (*p++ - '0');
+	if (p == tag_end || *p++ != ':')
+		return false;
+	if (tag_end - p < 2 || !is_digit(p[0]) || !is_digit(p[1]))
+		return false;
+	double seconds = (p[0] - '0') * 10 + (p[1] - '0');
+	p += 2;
+	if (p < tag_end) {
+		if (*p != '.' && *p != ':')
+			return false;
+		double unit = 0.1;
+		for (++p; p < tag_end; ++p, unit /= 10) {
+			if (!is_digit(*p))
+				return false;
+			seconds += (*p - '0') * unit;
+		}
+	}
+	time = minutes * 60.0 + seconds;
+	return true;
+}
+
+bool parse_lrc(const char *text, size_t size, lrc_lyrics &lyrics) {
+	const char *text_end = text + size;
+	vector<timed_line> lines;
+	vector<double> times;
+	size_t untimed = 0;
+	// [offset:+ms] makes the lyrics appear earlier
+	double offset = 0;
+	for (const char *line = text; line < text_end;) {
+		const char *line_end = static_cast<const char *>(memchr(line, '\n', text_end - line)) ?: text_end;
+		const char *next = line_end == text_end ? text_end : line_end + 1;
+		while (line_end > line && (line_end[-1] == '\r' || line_end[-1] == ' '))
+			--line_end;
+
+		times.clear();
+		const char *p = line;
+		while (p < line_end && *p == '[') {
+			const char *close = static_cast<const char *>(memchr(p, ']', line_end - p));
+			if (!close)
+				break;
+			double time;
+			if (parse_time(p + 1, close, time)) {
+				times.push_back(time);
+			} else if (times.empty() && close - p > 8 && strncmp(p + 1, "offset:", 7) == 0) {
+				offset = strtol(string(p + 8, close).c_str(), nullptr, 10) / 1000.0;
+			} else if (times.empty() && memchr(p, ':', close - p)) {
+				// other ID tags ([ar:...], [ti:...]) are not shown
+			} else {
+				break;
+			}
+			p = close + 1;
+		}
+
+		if (!times.empty()) {
+			for (double time : times)
+				lines.push_back({time, p, size_t(line_end - p)});
+		} else if (p == line && line_end > line) {
+			++untimed;
+		}
+		line = next;
+	}
+
+	// don't take ordinary lyrics with a stray tag for synchronized ones
+	if (lines.empty() || untimed >= lines.size())
+		return false;
+
+	stable_sort(lines.begin(), lines.end(), [](const timed_line &a, const timed_line &b) {
+		return a.time < b.time;
+	});
+	lyrics.text.clear();
+	lyrics.times.clear();
+	lyrics.times.reserve(lines.size());
+	for (const auto &line : lines) {
+		if (!lyrics.times.empty())
+			lyrics.text += '\n';
+		lyrics.text.append(line.text, line.size);
+		lyrics.times.push_back(max(0.0, line.time - offset));
+	}
+	return true;
+}
+
+ptrdiff_t lrc_line_at(const lrc_lyrics &lyrics, double position) {
+	auto next = upper_bound(lyrics.times.begin(), lyrics.times.end(), position);
+	return (next - lyrics.times.begin()) - 1;
+}
+
+double lrc_next_time(const lrc_lyrics &lyrics, double position) {
+	auto next = upper_bound(lyrics.times.begin(), lyrics.times.end(), position);
+	return next == lyrics.times.end() ? -1 : *next;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#ifndef LYRICBAR_LRC_H
+#define LYRICBAR_LRC_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * Synchronized lyrics: the text lines ordered by the time they are sung at.
+ */
+struct lrc_lyrics {
+	/** The lyrics without the time tags, one line per time tag. */
+	std::string text;
+	/** When every line of the text starts, in seconds; never decreasing. */
+	std::vector<double> times;
+};
+
+/**
+ * Parses the lyrics in the LRC format ([mm:ss.xx]line).
+ * @return false if the text is not synchronized lyrics
+ */
+bool parse_lrc(const char *text, size_t size, lrc_lyrics &lyrics);
+
+/**
+ * Finds the line being sung at the given position by binary search.
+ * @return the number of the line, or -1 if the position is before the first one
+ */
+ptrdiff_t lrc_line_at(const lrc_lyrics &lyrics, double position);
+
+/**
+ * @return when the line following the one being sung at the position starts,
+ *         or a negative number if there are no more lines
+ */
+double lrc_next_time(const lrc_lyrics &lyrics, double position);
+
+#endif // LYRICBAR_LRC_H
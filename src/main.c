@@ -1,10 +1,14 @@
 #include "main.h"
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
+#include "cache.h"
+#include "http.h"
 #include "ui.h"
 #include "utils.h"
+#include "workers.h"
 #include "gettext.h"
 
 static ddb_gtkui_t *gtkui_plugin;
@@ -16,37 +20,96 @@ static DB_misc_t plugin;
 
 static const char settings_dlg[] =
 	"property \"Lyrics alignment type\" select[3] lyricbar.lyrics.alignment 1 left center right;"
-	"property \"Custom lyrics fetching command\" entry lyricbar.customcmd \"\";";
+	"property \"Custom lyrics fetching command\" entry lyricbar.customcmd \"\";"
+	"property \"Custom command timeout (s, 0 to wait forever)\" entry lyricbar.customcmd.timeout 10;"
+	"property \"Query all the lyrics sources at once\" checkbox lyricbar.providers.parallel 0;"
+	"property \"Wait for better sources after the first result (ms)\" entry lyricbar.providers.grace 500;"
+	"property \"Prefetch lyrics for the next N tracks\" entry lyricbar.prefetch 2;"
+	"property \"Threads fetching lyrics for many tracks\" entry lyricbar.bulk.threads 4;"
+	"property \"Minimal interval between background requests to a site (ms)\" entry lyricbar.ratelimit 200;"
+	"property \"Connection timeout (ms)\" entry lyricbar.http.connect_timeout 5000;"
+	"property \"Give up if no data comes for (s)\" entry lyricbar.http.read_timeout 10;"
+	"property \"In-memory lyrics cache size (KB)\" entry lyricbar.cache.memsize 1024;"
+	"property \"Remember the missing lyrics for (hours, 0 to disable)\" entry lyricbar.cache.miss_ttl 24;"
+	"property \"Match the cached lyrics by\" select[3] lyricbar.cache.keys 2 \"exact names\" \"names ignoring case\" \"names ignoring case, articles and featured artists\";"
+	"property \"Lyrics cache storage\" select[2] lyricbar.cache.backend 0 \"file per song\" \"single indexed file\";"
+	"property \"Flush the cached lyrics to the disk\" select[3] lyricbar.cache.fsync 1 \"never\" \"file\" \"file and directory\";"
+	"property \"Cache file names\" select[2] lyricbar.cache.layout 0 \"artist-title\" \"hashed, in subdirectories\";";
 
 static int lyricbar_disconnect() {
+	lyrics_workers_stop();
+	http_cleanup();
 	if (gtkui_plugin) {
 		gtkui_plugin->w_unreg_widget(plugin.plugin.id);
 	}
 	return 0;
 }
 
+DB_plugin_action_t stop_fetch_action = {
+	.name = "stop_fetching_lyrics",
+	.flags = DB_ACTION_MULTIPLE_TRACKS | DB_ACTION_PLAYLIST | DB_ACTION_ADD_MENU,
+	.callback2 = stop_fetching_action,
+	.next = NULL,
+	.title = "Stop Fetching Lyrics"
+};
+
+DB_plugin_action_t fetch_action = {
+	.name = "fetch_lyrics",
+	.flags = DB_ACTION_MULTIPLE_TRACKS | DB_ACTION_PLAYLIST | DB_ACTION_ADD_MENU,
+	.callback2 = fetch_lyrics_action,
+	.next = &stop_fetch_action,
+	.title = "Fetch Lyrics"
+};
+
 DB_plugin_action_t remove_action = {
 	.name = "remove_lyrics",
 	.flags = DB_ACTION_MULTIPLE_TRACKS | DB_ACTION_ADD_MENU,
 	.callback2 = remove_from_cache_action,
-	.next = NULL,
+	.next = &fetch_action,
 	.title = "Remove Lyrics From Cache"
 };
 
+static const char *stop_fetch_title;
+
+// unlike the widget, the plugin gets the messages even if no lyricbar is shown
+static int
+lyricbar_message(uint32_t id, uintptr_t ctx, uint32_t p1, uint32_t p2) {
+	if (id == DB_EV_CONFIGCHANGED)
+		reload_cache_settings();
+	return 0;
+}
+
 static DB_plugin_action_t *
 lyricbar_get_actions() {
-	deadbeef->pl_lock();
+	// the progress of the bulk fetching is shown in the title of the action stopping it
+	static char stop_fetch_progress[128];
+	size_t processed, total;
+	if (lyrics_workers_bulk_progress(&processed, &total)) {
+		snprintf(stop_fetch_progress, sizeof(stop_fetch_progress), "%s (%zu/%zu)", stop_fetch_title, processed, total);
+		stop_fetch_action.title = stop_fetch_progress;
+		stop_fetch_action.flags &= (uint32_t)~DB_ACTION_DISABLED;
+	} else {
+		stop_fetch_action.title = stop_fetch_title;
+		stop_fetch_action.flags |= DB_ACTION_DISABLED;
+	}
+
 	remove_action.flags |= DB_ACTION_DISABLED;
-	DB_playItem_t *current = deadbeef->pl_get_first(PL_MAIN);
+	deadbeef->pl_lock();
+	// has_cache_entries() never touches the disk, so only the walk itself is paid for;
+	// it stops as soon as all the selected items are seen
+	int selected = deadbeef->pl_getselcount();
+	DB_playItem_t *current = selected > 0 ? deadbeef->pl_get_first(PL_MAIN) : NULL;
 	while (current) {
-		if (deadbeef->pl_is_selected(current) && is_cached(
-		            deadbeef->pl_find_meta(current, "artist"),
-		            deadbeef->pl_find_meta(current, "title"))) {
-			remove_action.flags &= (uint32_t)~DB_ACTION_DISABLED;
-			deadbeef->pl_item_unref(current);
-			break;
+		if (deadbeef->pl_is_selected(current)) {
+			--selected;
+			if (has_cache_entries(deadbeef->pl_find_meta(current, "artist"),
+			                      deadbeef->pl_find_meta(current, "title"))) {
+				remove_action.flags &= (uint32_t)~DB_ACTION_DISABLED;
+				deadbeef->pl_item_unref(current);
+				break;
+			}
 		}
-		DB_playItem_t *next = deadbeef->pl_get_next(current, PL_MAIN);
+		DB_playItem_t *next = selected > 0 ? deadbeef->pl_get_next(current, PL_MAIN) : NULL;
 		deadbeef->pl_item_unref(current);
 		current = next;
 	}
@@ -73,6 +136,7 @@ static int lyricbar_connect() {
 		fprintf(stderr, "%s: can't find gtkui plugin\n", plugin.plugin.id);
 		return -1;
 	}
+	http_init();
 	gtkui_plugin->w_reg_widget("Lyricbar", 0, w_lyricbar_create, "lyricbar", NULL);
 	return 0;
 }
@@ -88,6 +152,8 @@ DB_plugin_t *ddb_lyricbar_gtk3_load(DB_functions_t *ddb) {
 	bindtextdomain("deadbeef-lyricbar", "/usr/share/locale");
 	textdomain("deadbeef-lyricbar");
 	remove_action.title = _(remove_action.title);
+	fetch_action.title = _(fetch_action.title);
+	stop_fetch_title = _(stop_fetch_action.title);
 	ensure_lyrics_path_exists();
 	return DB_PLUGIN(&plugin);
 }
@@ -111,6 +177,7 @@ static DB_misc_t plugin = {
 	.plugin.connect = lyricbar_connect,
 	.plugin.disconnect = lyricbar_disconnect,
 	.plugin.configdialog = settings_dlg,
+	.plugin.message = lyricbar_message,
 	.plugin.get_actions = lyricbar_get_actions
 };
 
@@ -0,0 +1,265 @@
+#include "markup.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace {
+
+class markup_tokenizer {
+public:
+	markup_tokenizer(const char *text, size_t size)
+		: begin{text}
+		, end{text + size}
+		, pos{text}
+		, plain{text}
+	{}
+
+	vector<markup_span> run() {
+		start_line();
+		while (pos < end) {
+			if (pos == header_end) {
+				close_header();
+			} else if (pos == line_end) {
+				// the newline itself is a plain character
+				++pos;
+				start_line();
+			} else if (!try_mark()) {
+				++pos;
+			}
+		}
+		flush(end);
+		return move(spans);
+	}
+
+private:
+	const char *const begin;
+	const char *const end;
+	const char *pos;
+	// the start of the text not emitted yet
+	const char *plain;
+	const char *line_end = nullptr;
+	const char *header_end = nullptr;
+	const char *header_marks_end = nullptr;
+	// where the marks must be closed: the end of the line or of the header
+	const char *stop = nullptr;
+	// the closing brackets of the link found last
+	const char *link_end = nullptr;
+	// whether there is no closing bracket until the end of the line
+	bool no_link_end = false;
+	bool no_url_end = false;
+	unsigned style = 0;
+	vector<markup_span> spans;
+
+	void emit(const char *from, const char *to, unsigned span_style) {
+		if (from == to && !(span_style & MARKUP_BREAK))
+			return;
+		size_t offset = from - begin;
+		if (!spans.empty() && !(span_style & MARKUP_BREAK)) {
+			auto &last = spans.back();
+			if (last.style == span_style && last.offset + last.length == offset) {
+				last.length += to - from;
+				return;
+			}
+		}
+		spans.push_back({offset, size_t(to - from), span_style});
+	}
+
+	void flush(const char *to) {
+		emit(plain, to, style);
+	}
+
+	/**
+	 * Skips the mark, emitting the text before it.
+	 */
+	void skip(const char *mark, const char *mark_end) {
+		flush(mark);
+		pos = plain = mark_end;
+	}
+
+	void start_line() {
+		line_end = static_cast<const char *>(memchr(pos, '\n', end - pos)) ?: end;
+		stop = line_end;
+		no_link_end = no_url_end = false;
+		open_header();
+	}
+
+	void open_header() {
+		const char *last = line_end;
+		while (last > pos && (last[-1] == ' ' || last[-1] == '\t' || last[-1] == '\r'))
+			--last;
+		const char *first = pos;
+		while (first < last && *first == '=')
+			++first;
+		const char *close = last;
+		while (close > first && close[-1] == '=')
+			--close;
+		if (first - pos < 2 || last - close < 2 || close == first)
+			return;
+		// the spaces around the title are part of the marks
+		while (first < close && *first == ' ')
+			++first;
+		while (close > first && close[-1] == ' ')
+			--close;
+		skip(pos, first);
+		style |= MARKUP_HEADER;
+		header_end = stop = close;
+		header_marks_end = last;
+	}
+
+	void close_header() {
+		flush(pos);
+		style &= ~MARKUP_HEADER;
+		header_end = nullptr;
+		stop = line_end;
+		no_link_end = no_url_end = false;
+		pos = plain = header_marks_end;
+	}
+
+	bool try_mark() {
+		switch (*pos) {
+			case '\'':
+				return quotes();
+			case '[':
+				return pos + 1 < stop && pos[1] == '[' ? link() : external_link();
+			case '<':
+				return line_break();
+			default:
+				return false;
+		}
+	}
+
+	bool quotes() {
+		const char *run_end = pos;
+		while (run_end < stop && *run_end == '\'')
+			++run_end;
+		size_t count = run_end - pos;
+		if (count < 2) {
+			pos = run_end;
+			return true;
+		}
+		// as in MediaWiki, the extra apostrophes stay in the text
+		unsigned toggle;
+		size_t mark_size;
+		if (count == 2) {
+			toggle = MARKUP_ITALIC;
+			mark_size = 2;
+		} else if (count < 5) {
+			toggle = MARKUP_BOLD;
+			mark_size = 3;
+		} else {
+			toggle = MARKUP_ITALIC | MARKUP_BOLD;
+			mark_size = 5;
+		}
+		skip(run_end - mark_size, run_end);
+		style ^= toggle;
+		return true;
+	}
+
+	bool link() {
+		if (no_link_end)
+			return false;
+		static const char closing[] = "]]";
+		static const char opening[] = "[[";
+		if (link_end < pos + 2) {
+			link_end = search(pos + 2, stop, closing, closing + 2);
+			if (link_end == stop) {
+				no_link_end = true;
+				return false;
+			}
+		}
+		const char *close = link_end;
+		// only the innermost of the nested openings makes the link
+		if (search(pos + 2, close, opening, opening + 2) != close)
+			return false;
+		const char *caption = find(pos + 2, close, '|');
+		caption = caption == close ? pos + 2 : caption + 1;
+		flush(pos);
+		emit(caption, close, style | MARKUP_LINK);
+		pos = plain = close + 2;
+		return true;
+	}
+
+	bool external_link() {
+		if (no_url_end)
+			return false;
+		size_t left = stop - pos - 1;
+		bool url = (left > 7 && memcmp(pos + 1, "http://", 7) == 0)
+		        || (left > 8 && memcmp(pos + 1, "https://", 8) == 0);
+		if (!url)
+			return false;
+		const char *close = find(pos + 1, stop, ']');
+		if (close == stop) {
+			no_url_end = true;
+			return false;
+		}
+		const char *caption = find(pos + 1, close, ' ');
+		caption = caption == close ? pos + 1 : caption + 1;
+		flush(pos);
+		emit(caption, close, style | MARKUP_LINK);
+		pos = plain = close + 1;
+		return true;
+	}
+
+	bool line_break() {
+		const char *p = pos + 1;
+		if (stop - p < 3 || (p[0] | 0x20) != 'b' || (p[1] | 0x20) != 'r')
+			return false;
+		p += 2;
+		while (p < stop && *p == ' ')
+			++p;
+		if (p < stop && *p == '/')
+			++p;
+		if (p == stop || *p != '>')
+			return false;
+		flush(pos);
+		emit(pos, pos, MARKUP_BREAK);
+		pos = plain = p + 1;
+		return true;
+	}
+};
+
+} // namespace
+
+vector<markup_span> tokenize_markup(const char *text, size_t size) {
+	return markup_tokenizer{text, size}.run();
+}
+
+static
+bool is_space(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+bool extract_lyrics_blocks(const char *text, size_t size, string &lyrics) {
+	static const char open_tag[] = "<lyrics>";
+	static const char close_tag[] = "</lyrics>";
+	const char *open_end = open_tag + sizeof(open_tag) - 1;
+	const char *close_end = close_tag + sizeof(close_tag) - 1;
+
+	const char *text_end = text + size;
+	bool found = false;
+	lyrics.clear();
+	// every byte is looked at a bounded number of times: each search starts where the previous ended
+	while (true) {
+		const char *open = search(text, text_end, open_tag, open_end);
+		if (open == text_end)
+			break;
+		const char *block = open + (open_end - open_tag);
+		const char *close = search(block, text_end, close_tag, close_end);
+		if (close == text_end)
+			break;
+		text = close + (close_end - close_tag);
+
+		const char *block_end = close;
+		while (block < block_end && is_space(*block))
+			++block;
+		while (block_end > block && is_space(block_end[-1]))
+			--block_end;
+		if (!lyrics.empty() && block < block_end)
+			lyrics += "\n\n";
+		lyrics.append(block, block_end);
+		found = true;
+	}
+	return found;
+}
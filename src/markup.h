@@ -0,0 +1,41 @@
+#pragma once
+#ifndef LYRICBAR_MARKUP_H
+#define LYRICBAR_MARKUP_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+enum markup_style : unsigned {
+	MARKUP_ITALIC = 1U << 0U,
+	MARKUP_BOLD   = 1U << 1U,
+	MARKUP_LINK   = 1U << 2U,
+	MARKUP_HEADER = 1U << 3U,
+	/** A line break (<br>); the span is empty. */
+	MARKUP_BREAK  = 1U << 4U,
+};
+
+/**
+ * A piece of the text to be shown with the given combination of markup_style flags.
+ */
+struct markup_span {
+	size_t offset;
+	size_t length;
+	unsigned style;
+};
+
+/**
+ * Splits the wiki markup into the spans to show, in a single pass over the bytes.
+ * Understands ''italic'', '''bold''', [[links|captions]], [http://external links],
+ * == headers == and <br>; the marks themselves are left out of the spans.
+ */
+std::vector<markup_span> tokenize_markup(const char *text, size_t size);
+
+/**
+ * Collects the contents of all the <lyrics> blocks of a wiki page in a single
+ * pass, with the surrounding whitespace trimmed and a blank line between them.
+ * @return false if the page has no complete block
+ */
+bool extract_lyrics_blocks(const char *text, size_t size, std::string &lyrics);
+
+#endif // LYRICBAR_MARKUP_H
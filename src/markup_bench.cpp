@@ -0,0 +1,138 @@
+/**
+ * Times the markup parsing on generated inputs of a few sizes, the <lyrics>
+ * extraction against the std::regex it has replaced; run with `make bench`.
+ * Not a part of the plugin.
+ */
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <regex>
+#include <string>
+
+#include "markup.h"
+
+using namespace std;
+
+static const char *const SAMPLE_LINES[] = {
+	"== Verse 1 ==\n",
+	"I've been ''walking'' down the road, the '''long''' one<br>\n",
+	"Singing [[Some Artist|songs]] of the [http://example.com old days]\n",
+	"Plain line without any markup at all, just words and words\n",
+	"'''''All of it''''' at once, then [[a plain link]] and ''more''\n",
+	"Последняя строка в UTF-8, ''курсивом''\n",
+};
+
+static
+string generate_markup(size_t size) {
+	string text;
+	text.reserve(size);
+	for (size_t i = 0; text.size() < size; ++i)
+		text += SAMPLE_LINES[i % (sizeof(SAMPLE_LINES) / sizeof(SAMPLE_LINES[0]))];
+	text.resize(size);
+	return text;
+}
+
+/**
+ * A LyricWiki revision of about the given size: the lyrics block makes up
+ * the most of it, the page template surrounds it.
+ */
+static
+string generate_revision(size_t size) {
+	static const string header = "{{Song|Some Album (2001)|Some Artist|star=Green}}\n"
+	                             "{{SongHeader\n|song = Some Song\n|artist = Some Artist\n}}\n";
+	static const string footer = "\n{{SongFooter\n|fLetter = S\n|iTunes = 123456\n}}\n"
+	                             "[[Category:Review Me]]\n";
+	string page = header + "<lyrics>\n";
+	size_t overhead = page.size() + strlen("\n</lyrics>") + footer.size();
+	page += generate_markup(size > overhead ? size - overhead : 0);
+	page += "\n</lyrics>" + footer;
+	return page;
+}
+
+/**
+ * What the lyrics were extracted with before extract_lyrics_blocks.
+ */
+static
+string extract_with_regex(const string &page) {
+	static const regex r{R"(<lyrics>\s*([^]*?)\s*</lyrics>)"};
+	smatch match;
+	regex_search(page, match, r);
+	return match[1];
+}
+
+/**
+ * Runs the function in a child process, so that its crash can be reported.
+ * @return false if the child has crashed
+ */
+static
+bool run_isolated(const function<void()> &f) {
+	cout.flush();
+	pid_t pid = fork();
+	if (pid == 0) {
+		f();
+		cout.flush();
+		_exit(0);
+	}
+	int status;
+	return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Runs the function until at least 200 ms have passed.
+ * @return the average time of a run in microseconds
+ */
+template <typename F>
+static
+double time_runs(F f) {
+	using clock = chrono::steady_clock;
+	auto start = clock::now();
+	size_t runs = 0;
+	chrono::duration<double, micro> elapsed;
+	do {
+		f();
+		++runs;
+		elapsed = clock::now() - start;
+	} while (elapsed < chrono::milliseconds(200));
+	return elapsed.count() / runs;
+}
+
+static
+void report(const char *what, size_t size, double us) {
+	cout << setw(28) << left << what << setw(8) << right << size / 1024 << " KB "
+	     << setw(12) << fixed << setprecision(1) << us << " us "
+	     << setw(10) << setprecision(1) << size / us << " MB/s\n";
+}
+
+int main() {
+	const size_t sizes[] = {1U << 10U, 100U << 10U, 1U << 20U};
+	size_t sink = 0; // keeps the results alive
+
+	for (size_t size : sizes) {
+		string text = generate_markup(size);
+		double us = time_runs([&] { sink += tokenize_markup(text.data(), text.size()).size(); });
+		report("tokenize_markup", size, us);
+	}
+
+	for (size_t size : sizes) {
+		string page = generate_revision(size);
+		string lyrics;
+		double us = time_runs([&] { sink += extract_lyrics_blocks(page.data(), page.size(), lyrics); });
+		report("extract_lyrics_blocks", size, us);
+		// the backtracking regex recurses per character and may exhaust the stack
+		bool survived = run_isolated([&] {
+			if (extract_with_regex(page) != lyrics)
+				cerr << "the regex result differs from extract_lyrics_blocks!\n";
+			report("std::regex", size, time_runs([&] { sink += extract_with_regex(page).size(); }));
+		});
+		if (!survived) {
+			cout << setw(28) << left << "std::regex" << setw(8) << right << size / 1024
+			     << " KB crashed\n";
+		}
+	}
+	return sink == 0;
+}
@@ -1,5 +1,7 @@
 #include "ui.h"
 
+#include <algorithm>
+#include <cstring>
 #include <memory>
 #include <vector>
 
@@ -12,7 +14,10 @@
 
 #include "debug.h"
 #include "gettext.h"
+#include "lrc.h"
+#include "markup.h"
 #include "utils.h"
+#include "workers.h"
 
 using namespace std;
 using namespace Gtk;
@@ -22,54 +27,381 @@ using namespace Glib;
 static TextView *lyricView;
 static ScrolledWindow *lyricbar;
 static RefPtr<TextBuffer> refBuffer;
-static RefPtr<TextTag> tagItalic, tagBold, tagLarge, tagCenter;
+static RefPtr<TextBuffer::Mark> markScroll;
+static RefPtr<TextTag> tagItalic, tagBold, tagLarge, tagCenter, tagLink, tagHeader, tagCurrent;
 static vector<RefPtr<TextTag>> tagsTitle, tagsArtist;
 
+namespace {
+
+// in addition to the markup_style flags
+enum text_style : unsigned {
+	STYLE_TITLE  = 1U << 8U,
+	STYLE_ARTIST = 1U << 9U,
+};
+
+struct text_segment {
+	const char *text;
+	size_t size;
+	unsigned style;
+};
+
+struct text_position {
+	size_t segment;
+	size_t offset;
+};
+
+/**
+ * The contents of the lyrics panel, split into the differently styled segments.
+ * The segments point into the strings held by the document.
+ */
+struct lyrics_document {
+	DB_playItem_t *track;
+	string title;
+	string artist;
+	lyrics_ptr lyrics;
+	/** The synchronized lyrics, if they are such; the segments point into their text. */
+	shared_ptr<const lrc_lyrics> synced;
+	vector<text_segment> segments;
+	/** Where every line starts, followed by the end of the text. */
+	vector<text_position> lines;
+	/** The line the lyrics start at, after the title and artist. */
+	size_t lyrics_line;
+
+	size_t line_count() const {
+		return lines.size() - 1;
+	}
+};
+
+} // namespace
+
+// longer documents are shown by windows of this many lines
+static const size_t WINDOW_LINES = 300;
+// the window is moved when the view gets this close to its edge
+static const size_t WINDOW_MARGIN = 75;
+
+// the document the buffer currently shows
+static shared_ptr<const lyrics_document> shown;
+// the lines of the shown document that are in the buffer, if it is windowed
+static size_t window_first, window_end;
+static bool moving_window;
+
+// how long after the start of the next line the timer fires, in ms
+static const unsigned POSITION_SLACK = 10;
+
+// fires once when the next line of the synchronized lyrics starts
+static sigc::connection position_timer;
+// the line of the synchronized lyrics being sung
+static ptrdiff_t current_line = -1;
+
+static
+bool windowed(const lyrics_document &doc) {
+	return doc.line_count() > WINDOW_LINES;
+}
+
+static
+void index_lines(lyrics_document &doc) {
+	doc.lines.push_back({0, 0});
+	for (size_t i = 0; i < doc.segments.size(); ++i) {
+		const auto &seg = doc.segments[i];
+		const char *text = seg.text;
+		const char *text_end = seg.text + seg.size;
+		while (auto newline = static_cast<const char *>(memchr(text, '\n', text_end - text))) {
+			text = newline + 1;
+			doc.lines.push_back({i, size_t(text - seg.text)});
+		}
+	}
+	doc.lines.push_back({doc.segments.size(), 0});
+}
+
+static
+void append_markup(const char *text, size_t size, vector<text_segment> &segments) {
+	for (const auto &span : tokenize_markup(text, size)) {
+		if (span.style & MARKUP_BREAK)
+			segments.push_back({"\n", 1, 0});
+		else
+			segments.push_back({text + span.offset, span.length, span.style});
+	}
+}
+
+/**
+ * Prepares the document for the track, off the main loop.
+ * @return nullptr if the track is not playing anymore
+ */
+static
+shared_ptr<const lyrics_document> build_document(DB_playItem_t *track, lyrics_ptr lyrics) {
+	auto doc = make_shared<lyrics_document>();
+	{
+		pl_lock_guard guard;
+
+		if (!is_playing(track))
+			return nullptr;
+		const char *artist = deadbeef->pl_find_meta(track, "artist") ?: _("Unknown Artist");
+		doc->title = deadbeef->pl_find_meta(track, "title") ?: _("Unknown Title");
+		doc->artist = string{"\n"} + artist + "\n\n";
+	}
+	doc->track = track;
+	doc->lyrics = move(lyrics);
+	doc->segments.push_back({doc->title.data(), doc->title.size(), STYLE_TITLE});
+	doc->segments.push_back({doc->artist.data(), doc->artist.size(), STYLE_ARTIST});
+	doc->lyrics_line = count(doc->title.begin(), doc->title.end(), '\n')
+	                 + count(doc->artist.begin(), doc->artist.end(), '\n');
+	auto synced = make_shared<lrc_lyrics>();
+	if (parse_lrc(doc->lyrics->data(), doc->lyrics->size(), *synced)) {
+		doc->segments.push_back({synced->text.data(), synced->text.size(), 0});
+		doc->synced = move(synced);
+	} else {
+		append_markup(doc->lyrics->data(), doc->lyrics->size(), doc->segments);
+	}
+	index_lines(*doc);
+	return doc;
+}
+
+static
+vector<RefPtr<TextTag>> style_tags(unsigned style) {
+	if (style & STYLE_TITLE)
+		return tagsTitle;
+	if (style & STYLE_ARTIST)
+		return tagsArtist;
+	vector<RefPtr<TextTag>> tags;
+	if (style & MARKUP_ITALIC) tags.push_back(tagItalic);
+	if (style & MARKUP_BOLD)   tags.push_back(tagBold);
+	if (style & MARKUP_LINK)   tags.push_back(tagLink);
+	if (style & MARKUP_HEADER) tags.push_back(tagHeader);
+	return tags;
+}
+
+static
+bool same_segment(const text_segment &a, const text_segment &b) {
+	return a.style == b.style && a.size == b.size && equal(a.text, a.text + a.size, b.text);
+}
+
+static
+void insert_range(const lyrics_document &doc, text_position from, text_position to) {
+	for (size_t i = from.segment; i < doc.segments.size() && i <= to.segment; ++i) {
+		const auto &seg = doc.segments[i];
+		size_t from_offset = i == from.segment ? from.offset : 0;
+		size_t to_offset = i == to.segment ? to.offset : seg.size;
+		if (to_offset > from_offset)
+			refBuffer->insert_with_tags(refBuffer->end(), seg.text + from_offset, seg.text + to_offset, style_tags(seg.style));
+	}
+}
+
+/**
+ * Marks the current line of the synchronized lyrics if it is in the buffer.
+ */
+static
+void highlight_current_line(bool scroll) {
+	refBuffer->remove_tag(tagCurrent, refBuffer->begin(), refBuffer->end());
+	if (!shown || !shown->synced || current_line < 0)
+		return;
+	size_t line = shown->lyrics_line + current_line;
+	size_t first = windowed(*shown) ? window_first : 0;
+	size_t end = windowed(*shown) ? window_end : shown->line_count();
+	if (line < first || line >= end)
+		return;
+
+	auto line_start = refBuffer->get_iter_at_line(int(line - first));
+	auto line_end = line_start;
+	line_end.forward_to_line_end();
+	refBuffer->apply_tag(tagCurrent, line_start, line_end);
+	if (scroll) {
+		refBuffer->move_mark(markScroll, line_start);
+		lyricView->scroll_to(markScroll, 0, 0, 0.5);
+	}
+}
+
+/**
+ * Fills the buffer with the lines of the shown document starting from the given one.
+ */
+static
+void show_window(size_t first) {
+	window_first = min(first, shown->line_count() - WINDOW_LINES);
+	window_end = window_first + WINDOW_LINES;
+	refBuffer->erase(refBuffer->begin(), refBuffer->end());
+	insert_range(*shown, shown->lines[window_first], shown->lines[window_end]);
+	highlight_current_line(false);
+}
+
+static
+bool on_position_timer();
+
+/**
+ * Arms the timer for the moment the line after the one at the position starts,
+ * unless the playback is paused or there are no more lines.
+ */
+static
+void schedule_next_line(double position) {
+	DB_output_t *output = deadbeef->get_output();
+	if (!output || output->state() != OUTPUT_STATE_PLAYING)
+		return;
+	double next = lrc_next_time(*shown->synced, position);
+	if (next < 0)
+		return;
+	auto delay = unsigned((next - position) * 1000) + POSITION_SLACK;
+	position_timer = signal_timeout().connect(sigc::ptr_fun(on_position_timer), delay);
+}
+
+/**
+ * Highlights the line of the synchronized lyrics for the playback position
+ * and schedules the next update.
+ */
+static
+void show_position() {
+	position_timer.disconnect();
+	{
+		pl_lock_guard guard;
+
+		if (!is_playing(shown->track))
+			return;
+	}
+	double position = deadbeef->streamer_get_playpos();
+	ptrdiff_t line = lrc_line_at(*shown->synced, position);
+	if (line != current_line) {
+		current_line = line;
+
+		size_t doc_line = shown->lyrics_line + max<ptrdiff_t>(line, 0);
+		if (windowed(*shown) && (doc_line < window_first || doc_line >= window_end)) {
+			moving_window = true;
+			show_window(doc_line - min(doc_line, WINDOW_LINES / 2));
+			moving_window = false;
+		}
+		highlight_current_line(true);
+	}
+	schedule_next_line(position);
+}
+
+static
+bool on_position_timer() {
+	if (shown && shown->synced)
+		show_position();
+	return false;
+}
+
+/**
+ * Updates the synchronized lyrics after the playback position jumped or
+ * the playback was paused or resumed.
+ */
+static
+void resync_position() {
+	signal_idle().connect_once([] {
+		if (shown && shown->synced)
+			show_position();
+		else
+			position_timer.disconnect();
+	});
+}
+
+/**
+ * Moves the window of a long document to keep the visible lines well inside it.
+ */
+static
+void on_scroll() {
+	if (!shown || !windowed(*shown) || moving_window)
+		return;
+	auto adjustment = lyricbar->get_vadjustment();
+	TextIter top, bottom;
+	int line_top;
+	lyricView->get_line_at_y(top, int(adjustment->get_value()), line_top);
+	lyricView->get_line_at_y(bottom, int(adjustment->get_value() + adjustment->get_page_size()), line_top);
+	size_t top_line = window_first + top.get_line();
+	bool near_start = window_first > 0 && size_t(top.get_line()) < WINDOW_MARGIN;
+	bool near_end = window_end < shown->line_count() && size_t(bottom.get_line()) + WINDOW_MARGIN >= WINDOW_LINES;
+	if (!near_start && !near_end)
+		return;
+
+	moving_window = true;
+	show_window(top_line - min(top_line, WINDOW_LINES / 2));
+	refBuffer->move_mark(markScroll, refBuffer->get_iter_at_line(int(top_line - window_first)));
+	lyricView->scroll_to(markScroll, 0, 0, 0);
+	moving_window = false;
+}
+
+/**
+ * Starts following the playback position if the shown lyrics are synchronized.
+ */
+static
+void follow_position() {
+	if (shown->synced)
+		show_position();
+	else
+		position_timer.disconnect();
+}
+
+/**
+ * Puts the document into the buffer, leaving alone the beginning it shares
+ * with the one shown now (e.g. the title when the lyrics are replaced, or the
+ * cropped lyrics when the complete ones arrive).
+ */
+static
+void render(shared_ptr<const lyrics_document> doc) {
+	current_line = -1;
+	if (windowed(*doc)) {
+		// stay at the same place when the lyrics of the track are updated
+		bool same_track = shown && windowed(*shown) && shown->track == doc->track;
+		shown = move(doc);
+		moving_window = true;
+		show_window(same_track ? window_first : 0);
+		moving_window = false;
+		follow_position();
+		return;
+	}
+	if (shown && windowed(*shown))
+		shown.reset();
+
+	const auto &segments = doc->segments;
+	size_t same = 0;       // segments kept intact
+	size_t same_bytes = 0; // bytes kept of the first changed segment
+	int kept_chars = 0;
+	if (shown) {
+		const auto &old_segments = shown->segments;
+		while (same < segments.size() && same < old_segments.size()
+		       && same_segment(segments[same], old_segments[same])) {
+			kept_chars += g_utf8_strlen(segments[same].text, segments[same].size);
+			++same;
+		}
+		if (same < segments.size() && same < old_segments.size()
+		        && segments[same].style == old_segments[same].style) {
+			const auto &seg = segments[same];
+			const auto &old_seg = old_segments[same];
+			size_t common = min(seg.size, old_seg.size);
+			same_bytes = mismatch(seg.text, seg.text + common, old_seg.text).first - seg.text;
+			// don't split a character
+			while (same_bytes > 0 && same_bytes < seg.size && (seg.text[same_bytes] & 0xC0) == 0x80)
+				--same_bytes;
+			kept_chars += g_utf8_strlen(seg.text, same_bytes);
+		}
+	}
+
+	refBuffer->erase(refBuffer->get_iter_at_offset(kept_chars), refBuffer->end());
+	for (size_t i = same; i < segments.size(); ++i) {
+		const auto &seg = segments[i];
+		size_t skip = i == same ? same_bytes : 0;
+		if (seg.size > skip)
+			refBuffer->insert_with_tags(refBuffer->end(), seg.text + skip, seg.text + seg.size, style_tags(seg.style));
+	}
+	shown = move(doc);
+	highlight_current_line(false);
+	follow_position();
+}
+
 void set_lyrics(DB_playItem_t *track, ustring lyrics) {
-	signal_idle().connect_once([track, lyrics = move(lyrics)] {
-		ustring artist, title;
+	set_lyrics(track, make_shared<lyrics_text>(lyrics.raw()));
+}
+
+void set_lyrics(DB_playItem_t *track, lyrics_ptr lyrics) {
+	auto doc = build_document(track, move(lyrics));
+	if (!doc)
+		return;
+	// only swapping the prepared document in is left to the main loop
+	signal_idle().connect_once([doc = move(doc)] {
 		{
 			pl_lock_guard guard;
 
-			if (!is_playing(track))
+			if (!is_playing(doc->track))
 				return;
-			artist = deadbeef->pl_find_meta(track, "artist") ?: _("Unknown Artist");
-			title  = deadbeef->pl_find_meta(track, "title") ?: _("Unknown Title");
 		}
-		refBuffer->erase(refBuffer->begin(), refBuffer->end());
-		refBuffer->insert_with_tags(refBuffer->begin(), title, tagsTitle);
-		refBuffer->insert_with_tags(refBuffer->end(), ustring{"\n"} + artist + "\n\n", tagsArtist);
-
-		bool italic = false;
-		bool bold = false;
-		size_t prev_mark = 0;
-		vector<RefPtr<TextTag>> tags;
-		while (prev_mark != ustring::npos) {
-			size_t italic_mark = lyrics.find("''", prev_mark);
-			if (italic_mark == ustring::npos) {
-				refBuffer->insert(refBuffer->end(), lyrics.substr(prev_mark));
-				break;
-			}
-			size_t bold_mark = ustring::npos;
-			if (italic_mark < lyrics.size() - 2 && lyrics[italic_mark + 2] == '\'')
-				bold_mark = italic_mark;
-
-			tags.clear();
-			if (italic) tags.push_back(tagItalic);
-			if (bold)   tags.push_back(tagBold);
-			refBuffer->insert_with_tags(refBuffer->end(),
-			                            lyrics.substr(prev_mark, min(bold_mark, italic_mark) - prev_mark),
-			                            tags);
-
-			if (bold_mark == ustring::npos) {
-				prev_mark = italic_mark + 2;
-				italic = !italic;
-			} else {
-				prev_mark = bold_mark + 3;
-				bold = !bold;
-			}
-		}
-		last = track;
+		render(doc);
+		last = doc->track;
 	});
 }
 
@@ -102,6 +434,18 @@ GtkWidget *construct_lyricbar() {
 	tagCenter = refBuffer->create_tag();
 	tagCenter->property_justification() = JUSTIFY_CENTER;
 
+	tagLink = refBuffer->create_tag();
+	tagLink->property_underline() = Pango::UNDERLINE_SINGLE;
+
+	tagCurrent = refBuffer->create_tag();
+	tagCurrent->property_weight() = Pango::WEIGHT_BOLD;
+
+	tagHeader = refBuffer->create_tag();
+	tagHeader->property_weight() = Pango::WEIGHT_BOLD;
+	tagHeader->property_scale() = Pango::SCALE_LARGE;
+
+	markScroll = refBuffer->create_mark(refBuffer->begin());
+
 	tagsTitle = {tagLarge, tagBold, tagCenter};
 	tagsArtist = {tagItalic, tagCenter};
 
@@ -118,6 +462,7 @@ GtkWidget *construct_lyricbar() {
 	lyricbar = new ScrolledWindow();
 	lyricbar->add(*lyricView);
 	lyricbar->set_policy(POLICY_AUTOMATIC, POLICY_AUTOMATIC);
+	lyricbar->get_vadjustment()->signal_value_changed().connect(sigc::ptr_fun(on_scroll));
 
 	return GTK_WIDGET(lyricbar->gobj());
 }
@@ -129,14 +474,21 @@ int message_handler(struct ddb_gtkui_widget_s*, uint32_t id, uintptr_t ctx, uint
 		case DB_EV_CONFIGCHANGED:
 			debug_out << "CONFIG CHANGED\n";
 			signal_idle().connect_once([]{ lyricView->set_justification(get_justification()); });
+			reload_custom_command();
+			break;
+		case DB_EV_SEEKED:
+		case DB_EV_PAUSED:
+			resync_position();
 			break;
 		case DB_EV_SONGSTARTED:
 			debug_out << "SONG STARTED\n";
+			resync_position();
 		case DB_EV_TRACKINFOCHANGED:
 			if (!event->track || event->track == last || deadbeef->pl_get_item_duration(event->track) <= 0)
 				return 0;
-			auto tid = deadbeef->thread_start(update_lyrics, event->track);
-			deadbeef->thread_detach(tid);
+			lyrics_workers_submit(event->track);
+			if (id == DB_EV_SONGSTARTED)
+				prefetch_upcoming(event->track);
 			break;
 	}
 
@@ -145,13 +497,19 @@ int message_handler(struct ddb_gtkui_widget_s*, uint32_t id, uintptr_t ctx, uint
 
 extern "C"
 void lyricbar_destroy() {
+	position_timer.disconnect();
 	delete lyricbar;
 	delete lyricView;
 	tagsArtist.clear();
 	tagsTitle.clear();
+	tagHeader.reset();
+	tagCurrent.reset();
+	tagLink.reset();
 	tagLarge.reset();
 	tagBold.reset();
 	tagItalic.reset();
+	shown.reset();
+	markScroll.reset();
 	refBuffer.reset();
 }
 
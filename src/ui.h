@@ -8,8 +8,15 @@
 
 #include <glibmm/ustring.h>
 
+#include "cache.h"
+
 void set_lyrics(DB_playItem_t * track, Glib::ustring lyrics);
 
+/**
+ * Shows the lyrics without copying them; the text must be valid UTF-8.
+ */
+void set_lyrics(DB_playItem_t * track, lyrics_ptr lyrics);
+
 extern "C" {
 #endif
 
@@ -1,24 +1,38 @@
 #include "utils.h"
 
+#include <poll.h>
+#include <signal.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <algorithm>
-#include <cassert>
-#include <cctype> // ::isspace
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <cstring>
-#include <fstream>
+#include <future>
 #include <iostream>
-#include <regex>
-#include <sstream>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
-#include <giomm.h>
+#include <glib.h>
 #include <glibmm/fileutils.h>
 #include <glibmm/uriutils.h>
 
+#include "cache.h"
 #include "debug.h"
 #include "gettext.h"
+#include "http.h"
+#include "markup.h"
 #include "ui.h"
+#include "workers.h"
 
 using namespace std;
 using namespace Glib;
@@ -26,57 +40,59 @@ using namespace Glib;
 const DB_playItem_t *last;
 
 static const ustring LW_FMT = "http://lyrics.wikia.com/api.php?action=lyrics&fmt=xml&artist=%1&song=%2";
-static const char *home_cache = getenv("XDG_CACHE_HOME");
-static const string lyrics_dir = (home_cache ? string(home_cache) : string(getenv("HOME")) + "/.cache")
-                               + "/deadbeef/lyrics/";
 
-static experimental::optional<ustring>(*const providers[])(DB_playItem_t *) = {&get_lyrics_from_script, &download_lyrics_from_lyricwiki};
+struct lyrics_provider {
+	const char *name;
+	experimental::optional<ustring> (*fetch)(DB_playItem_t *);
+	bool throttled; // whether lyricbar.ratelimit applies
+};
 
-inline string cached_filename(string artist, string title) {
-	replace(artist.begin(), artist.end(), '/', '_');
-	replace(title.begin(), title.end(), '/', '_');
-
-	return lyrics_dir + artist + '-' + title;
-}
-
-extern "C"
-bool is_cached(const char *artist, const char *title) {
-	return artist && title && access(cached_filename(artist, title).c_str(), 0) == 0;
-}
-
-extern "C"
-void ensure_lyrics_path_exists() {
-	mkpath(lyrics_dir, 0755);
-}
+// in the order of priority
+static const lyrics_provider providers[] = {
+	{"script", &get_lyrics_from_script, false},
+	{"lyricwiki", &download_lyrics_from_lyricwiki, true},
+};
+constexpr size_t PROVIDERS_COUNT = sizeof(providers) / sizeof(providers[0]);
 
 /**
- * Loads the cached lyrics
- * @param artist The artist name
- * @param title  The song title
- * @note         Have no idea about the encodings, so a bug possible here
+ * Spaces the requests to a provider at least lyricbar.ratelimit ms apart.
  */
-experimental::optional<ustring> load_cached_lyrics(const char *artist, const char *title) {
-	string filename = cached_filename(artist, title);
-	debug_out << "filename = '" << filename << "'\n";
-	try {
-		return {file_get_contents(filename)};
-	} catch (const FileError& error) {
-		debug_out << error.what();
-		return {};
+class rate_limiter {
+public:
+	/**
+	 * Waits for the turn of the caller.
+	 * @return false if the job got cancelled meanwhile
+	 */
+	bool wait();
+
+private:
+	mutex mtx;
+	chrono::steady_clock::time_point next_slot;
+};
+
+bool rate_limiter::wait() {
+	auto interval = chrono::milliseconds(max(0, deadbeef->conf_get_int("lyricbar.ratelimit", 200)));
+	chrono::steady_clock::time_point slot;
+	{
+		lock_guard<mutex> lock(mtx);
+		slot = max(chrono::steady_clock::now(), next_slot);
+		next_slot = slot + interval;
 	}
-}
-
-bool save_cached_lyrics(const string &artist, const string &title, const string &lyrics) {
-	string filename = cached_filename(artist, title);
-	ofstream t(filename);
-	if (!t) {
-		cerr << "lyricbar: could not open file for writing: " << filename << endl;
-		return false;
+	while (chrono::steady_clock::now() < slot) {
+		if (job_cancelled())
+			return false;
+		this_thread::sleep_for(min<chrono::steady_clock::duration>(slot - chrono::steady_clock::now(),
+		                                                           chrono::milliseconds(50)));
 	}
-	t << lyrics;
 	return true;
 }
 
+static array<rate_limiter, PROVIDERS_COUNT> rate_limiters;
+
+// lookups currently running, keyed by the cache key
+static mutex inflight_mutex;
+static unordered_map<string, shared_future<experimental::optional<ustring>>> inflight;
+
 bool is_playing(DB_playItem_t *track) {
 	DB_playItem_t *pl_track = deadbeef->streamer_get_playing_track();
 	if (!pl_track)
@@ -89,7 +105,8 @@ bool is_playing(DB_playItem_t *track) {
 static
 experimental::optional<ustring> get_lyrics_from_metadata(DB_playItem_t *track) {
 	pl_lock_guard guard;
-	const char *lyrics = deadbeef->pl_find_meta(track, "lyrics")
+	const char *lyrics = deadbeef->pl_find_meta(track, "SYNCEDLYRICS")
+	                  ?: deadbeef->pl_find_meta(track, "lyrics")
 	                  ?: deadbeef->pl_find_meta(track, "unsynced lyrics")
 	                  ?: deadbeef->pl_find_meta(track, "UNSYNCEDLYRICS");
 	if (lyrics)
@@ -97,40 +114,165 @@ experimental::optional<ustring> get_lyrics_from_metadata(DB_playItem_t *track) {
 	else return {};
 }
 
-experimental::optional<ustring> get_lyrics_from_script(DB_playItem_t *track) {
+// set by the providers when they could not answer, as opposed to having no lyrics
+static thread_local bool provider_failed;
+
+constexpr size_t MAX_SCRIPT_OUTPUT = size_t{1} << 20U;
+
+// the custom command is compiled once per change of lyricbar.customcmd
+static mutex script_mutex;
+static bool script_loaded = false;
+static string script_source;
+static shared_ptr<char> script_code;
+// tells the misses of the different commands apart
+static string script_id;
+
+static
+void load_custom_command() {
 	std::string buf = std::string(4096, '\0');
 	deadbeef->conf_get_str("lyricbar.customcmd", nullptr, &buf[0], buf.size());
-	if (!buf[0]) {
-		return {};
+	buf.resize(strlen(buf.c_str()));
+	if (script_loaded && buf == script_source)
+		return;
+
+	script_loaded = true;
+	script_source = move(buf);
+	gchar *hash = g_compute_checksum_for_data(G_CHECKSUM_SHA1, reinterpret_cast<const guchar *>(script_source.data()),
+	                                          script_source.size());
+	script_id.assign(hash, 8);
+	g_free(hash);
+	script_code.reset();
+	if (script_source.empty())
+		return;
+	script_code.reset(deadbeef->tf_compile(script_source.c_str()), deadbeef->tf_free);
+	if (!script_code) {
+		std::cerr << "lyricbar: Invalid script command!\n";
+	}
+}
+
+void reload_custom_command() {
+	lock_guard<mutex> lock(script_mutex);
+	load_custom_command();
+}
+
+/**
+ * Names the provider in the remembered misses: those of the script only
+ * hold for the command that has missed.
+ */
+static
+string miss_source(const lyrics_provider &provider) {
+	if (provider.fetch != &get_lyrics_from_script)
+		return provider.name;
+	lock_guard<mutex> lock(script_mutex);
+	if (!script_loaded)
+		load_custom_command();
+	return string(provider.name) + '.' + script_id;
+}
+
+/**
+ * Runs the command, reading its stdout as it arrives.
+ * The child is killed if it runs longer than lyricbar.customcmd.timeout
+ * seconds or the job gets cancelled.
+ * @return true if the command exited with zero status
+ */
+static
+bool run_script(const string &command, string &output) {
+	Pid pid;
+	int in_fd = -1;
+	int out_fd = -1;
+	try {
+		spawn_async_with_pipes("", shell_parse_argv(command), SPAWN_SEARCH_PATH | SPAWN_DO_NOT_REAP_CHILD,
+		                       [] { setpgid(0, 0); }, // to kill its children too
+		                       &pid, &in_fd, &out_fd, nullptr);
+	} catch (const Glib::Error &e) {
+		std::cerr << "lyricbar: " << e.what() << "\n";
+		provider_failed = true;
+		return false;
+	}
+	close(in_fd);
+
+	int timeout = deadbeef->conf_get_int("lyricbar.customcmd.timeout", 10);
+	auto deadline = chrono::steady_clock::now() + chrono::seconds(timeout);
+	auto expired = [&] {
+		return job_cancelled() || (timeout > 0 && chrono::steady_clock::now() >= deadline);
+	};
+	constexpr int POLL_INTERVAL_MS = 100;
+
+	bool killed = false;
+	array<char, 4096> buf;
+	while (!(killed = expired())) {
+		pollfd pfd{out_fd, POLLIN, 0};
+		int ready = poll(&pfd, 1, POLL_INTERVAL_MS);
+		if (ready == 0 || (ready < 0 && errno == EINTR))
+			continue;
+		ssize_t nbytes = ready < 0 ? -1 : read(out_fd, buf.data(), buf.size());
+		if (nbytes < 0 && errno == EINTR)
+			continue;
+		if (nbytes <= 0)
+			break; // EOF or error
+		if (output.size() + nbytes > MAX_SCRIPT_OUTPUT) {
+			cerr << "lyricbar: script output is too large!\n";
+			killed = true;
+			break;
+		}
+		output.append(buf.data(), nbytes);
+	}
+	close(out_fd);
+
+	bool succeeded = false;
+	while (!killed) {
+		int status;
+		pid_t res = waitpid(pid, &status, WNOHANG);
+		if (res == pid) {
+			succeeded = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+			break;
+		} else if (res < 0 && errno != EINTR) {
+			break;
+		}
+		if ((killed = expired()))
+			break;
+		this_thread::sleep_for(chrono::milliseconds(POLL_INTERVAL_MS / 10));
+	}
+	if (killed) {
+		debug_out << "lyricbar: killing '" << command << "', "
+		          << (job_cancelled() ? "the track has been skipped\n" : "it took too long\n");
+		kill(-pid, SIGKILL);
+		kill(pid, SIGKILL);
+		waitpid(pid, nullptr, 0);
+		provider_failed = true;
+	}
+	spawn_close_pid(pid);
+	return succeeded;
+}
+
+experimental::optional<ustring> get_lyrics_from_script(DB_playItem_t *track) {
+	shared_ptr<char> tf_code;
+	{
+		lock_guard<mutex> lock(script_mutex);
+		if (!script_loaded)
+			load_custom_command();
+		tf_code = script_code;
 	}
-	auto tf_code = deadbeef->tf_compile(buf.data());
 	if (!tf_code) {
-		std::cerr << "lyricbar: Invalid script command!\n";
+		provider_failed = true;
 		return {};
 	}
 	ddb_tf_context_t ctx{};
 	ctx._size = sizeof(ctx);
 	ctx.it = track;
 
-	int command_len = deadbeef->tf_eval(&ctx, tf_code, &buf[0], buf.size());
-	deadbeef->tf_free(tf_code);
+	std::string buf = std::string(4096, '\0');
+	int command_len = deadbeef->tf_eval(&ctx, tf_code.get(), &buf[0], buf.size());
 	if (command_len < 0) {
 		std::cerr << "lyricbar: Invalid script command!\n";
+		provider_failed = true;
 		return {};
 	}
 
 	buf.resize(command_len);
 
 	std::string script_output;
-	int exit_status = 0;
-	try {
-		spawn_command_line_sync(buf, &script_output, nullptr, &exit_status);
-	} catch (const Glib::Error &e) {
-		std::cerr << "lyricbar: " << e.what() << "\n";
-		return {};
-	}
-
-	if (script_output.empty() || exit_status != 0) {
+	if (!run_script(buf, script_output) || script_output.empty()) {
 		return {};
 	}
 
@@ -142,30 +284,69 @@ experimental::optional<ustring> get_lyrics_from_script(DB_playItem_t *track) {
 	return {std::move(res)};
 }
 
+namespace {
+
+struct char_replacement {
+	gunichar from;
+	const char *to;
+};
+
+} // namespace
+
+// sorted by the code point for the binary search
+static const char_replacement replacements[] = {
+	{U'`', "'"},
+	{U'´', "'"},
+	{U'–', "-"},
+	{U'—', "-"},
+	{U'’', "'"},
+	{U'“', "\""},
+	{U'”', "\""},
+	{U'…', "..."},
+};
+
+static
 void char_asciify(gunichar c, ustring &out) {
-	switch (c) {
-		case U'’':
-		case U'´':
-		case U'`':
-			c = '\'';
-			break;
-		case U'“':
-		case U'”':
-			c = '"';
-			break;
-		case U'–':
-		case U'—':
-			c = '-';
-			break;
-		case U'…':
-			out.append(3, '.');
-			return;
-		}
-	out.push_back(c);
+	auto it = lower_bound(begin(replacements), end(replacements), c,
+	                      [](const char_replacement &r, gunichar c) { return r.from < c; });
+	if (it != end(replacements) && it->from == c)
+		out.append(it->to);
+	else
+		out.push_back(c);
+}
+
+/**
+ * Tells whether the string is plain ASCII, checking a word at a time.
+ */
+static
+bool is_ascii(const char *s, size_t size) {
+	constexpr uint64_t HIGH_BITS = 0x8080808080808080ULL;
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, s + i, sizeof(word));
+		if (word & HIGH_BITS)
+			return false;
+	}
+	for (; i < size; ++i) {
+		if (static_cast<unsigned char>(s[i]) & 0x80U)
+			return false;
+	}
+	return true;
 }
 
 void asciify(ustring &s) {
-	s.normalize(NormalizeMode::NORMALIZE_ALL_COMPOSE);
+	// ASCII is left intact by the normalization, only the backticks are to be replaced
+	if (is_ascii(s.data(), s.bytes())) {
+		if (s.raw().find('`') != string::npos) {
+			string raw = s.raw();
+			replace(raw.begin(), raw.end(), '`', '\'');
+			s = move(raw);
+		}
+		return;
+	}
+
+	s = s.normalize(NormalizeMode::NORMALIZE_ALL_COMPOSE);
 	ustring ans;
 	ans.reserve(s.bytes());
 	for (auto c : s) {
@@ -174,33 +355,85 @@ void asciify(ustring &s) {
 	s = std::move(ans);
 }
 
-std::string fetch_file(Gio::File &gfile) {
-	auto stream = gfile.read();
-	std::array<char, 4096> buf;
-	std::string res;
-	constexpr size_t MAX_FILE_SIZE = size_t{1} << 20U; // 1MB outta be enough
-	while (true) {
-		auto nbytes = stream->read(buf.data(), buf.size());
-		if (nbytes > 0) {
-			if (res.size() + nbytes > MAX_FILE_SIZE) {
-				cerr << "lyricbar: file '" << gfile.get_uri() << "' too large!\n";
-				throw std::runtime_error("file too large");
-			}
-			res.append(buf.data(), nbytes);
-		} else {
-			assert(nbytes == 0);
-			return res;
+namespace {
+
+/**
+ * Picks the text of the elements with the given names out of the XML
+ * as it is being parsed.
+ */
+class xml_text_collector : public xmlpp::SaxParser {
+public:
+	/**
+	 * Takes the name and the text of a complete element.
+	 * @return false if nothing more is needed from the document
+	 */
+	using handler = function<bool(const ustring &name, const ustring &text)>;
+
+	xml_text_collector(vector<ustring> names, handler on_element)
+		: names(move(names))
+		, on_element(move(on_element)) {}
+
+	bool done() const { return finished; }
+
+protected:
+	void on_start_element(const ustring &name, const AttributeList &) override {
+		if (!finished && capturing.empty() && find(names.begin(), names.end(), name) != names.end()) {
+			capturing = name;
+			text.clear();
 		}
 	}
-}
 
-experimental::optional<std::string> fetch_file(const std::string &uri) {
-	auto gfile = Gio::File::create_for_uri(uri);
-	try {
-		return {fetch_file(*gfile.get())};
-	} catch (...) {
-		return {};
+	void on_end_element(const ustring &name) override {
+		if (capturing.empty() || name != capturing)
+			return;
+		capturing.clear();
+		finished = !on_element(name, text);
+	}
+
+	void on_characters(const ustring &characters) override {
+		if (!capturing.empty())
+			text += characters;
+	}
+
+private:
+	vector<ustring> names;
+	handler on_element;
+	ustring capturing;
+	ustring text;
+	bool finished = false;
+};
+
+} // namespace
+
+/**
+ * Downloads the XML document feeding it to the parser chunk by chunk, so that
+ * the parsing goes along with the download; stops once the parser is done.
+ * @return false if the document couldn't be downloaded or parsed
+ */
+static
+bool parse_xml_from(const string &url, xml_text_collector &parser) {
+	string error;
+	bool downloaded = http_get(url, [&](const char *data, size_t size) {
+		try {
+			parser.parse_chunk_raw(reinterpret_cast<const unsigned char *>(data), size);
+		} catch (const exception &e) {
+			error = e.what();
+			return false;
+		}
+		return !parser.done();
+	});
+	if (downloaded && error.empty() && !parser.done()) {
+		try {
+			parser.finish_chunk_parsing();
+		} catch (const exception &e) {
+			error = e.what();
+		}
+	}
+	if (!error.empty()) {
+		cerr << "lyricbar: couldn't parse XML (URI is '" << url << "'), what(): " << error << endl;
+		return false;
 	}
+	return downloaded;
 }
 
 experimental::optional<ustring> download_lyrics_from_lyricwiki(DB_playItem_t *track) {
@@ -223,67 +456,275 @@ experimental::optional<ustring> download_lyrics_from_lyricwiki(DB_playItem_t *tr
 	                                         , uri_escape_string(title, {}, false));
 
 	string url;
-	auto doc = fetch_file(api_url);
-	if (!doc) {
-		return {};
-	}
-	try {
-		xmlpp::TextReader reader{reinterpret_cast<const unsigned char *>(doc->data()),
-		                         static_cast<xmlpp::TextReader::size_type>(doc->size())};
-
-		while (reader.read()) {
-			if (reader.get_node_type() == xmlpp::TextReader::NodeType::Element
-			        && reader.get_name() == "lyrics") {
-				reader.read();
-				if (reader.get_value() == "Not found")
-					return {};
-				else {
-					// got the cropped version of lyrics — display it before the complete one is got
-					set_lyrics(track, reader.get_value());
-				}
-			} else if (reader.get_name() == "url") {
-				reader.read();
-				url = reader.get_value();
-				break;
-			}
+	bool not_found = false;
+	xml_text_collector api_reader{{"lyrics", "url"}, [&](const ustring &name, const ustring &text) {
+		if (name == "url") {
+			url = text;
+			return false;
 		}
-	} catch (const exception &e) {
-		cerr << "lyricbar: couldn't parse XML (URI is '" << api_url << "'), what(): " << e.what() << endl;
+		if (text == "Not found") {
+			not_found = true;
+			return false;
+		}
+		// got the cropped version of lyrics — display it before the complete one is got
+		set_lyrics(track, text);
+		return true;
+	}};
+	if (!parse_xml_from(api_url, api_reader)) {
+		provider_failed = true;
 		return {};
 	}
+	if (not_found || url.empty())
+		return {};
 
 	url.replace(0, strlen("http://lyrics.wikia.com/"),
 	            "http://lyrics.wikia.com/api.php?action=query&prop=revisions&rvprop=content&format=xml&titles=");
 
-	doc = fetch_file(url);
-	if (!doc) {
+	string raw_lyrics;
+	xml_text_collector revision_reader{{"rev"}, [&](const ustring &, const ustring &text) {
+		raw_lyrics = text;
+		return false;
+	}};
+	if (!parse_xml_from(url, revision_reader)) {
+		provider_failed = true;
 		return {};
 	}
-	string raw_lyrics;
-	try {
-		xmlpp::TextReader reader{reinterpret_cast<const unsigned char *>(doc->data()),
-		                         static_cast<xmlpp::TextReader::size_type>(doc->size())};
-		while (reader.read()) {
-			if (reader.get_name() == "rev") {
-				reader.read();
-				raw_lyrics = reader.get_value();
-				break;
+
+	string lyrics;
+	if (!extract_lyrics_blocks(raw_lyrics.data(), raw_lyrics.size(), lyrics))
+		return {};
+	return ustring{move(lyrics)};
+}
+
+/**
+ * Asks the provider for the lyrics, respecting its rate limit unless
+ * the track is playing right now. The provider is not asked again while
+ * it is remembered to have no lyrics for the song.
+ */
+static
+experimental::optional<ustring> call_provider(size_t i, DB_playItem_t *track,
+                                              const string &artist, const string &title) {
+	string source = miss_source(providers[i]);
+	if (is_cached_miss(source, artist, title)) {
+		debug_out << "lyricbar: '" << providers[i].name << "' is known to have no lyrics for '"
+		          << artist << " - " << title << "'\n";
+		return {};
+	}
+	if (providers[i].throttled && !is_playing(track) && !rate_limiters[i].wait())
+		return {};
+	provider_failed = false;
+	auto lyrics = providers[i].fetch(track);
+	if (!lyrics && !provider_failed && !job_cancelled())
+		save_cached_miss(source, artist, title);
+	return lyrics;
+}
+
+/**
+ * Asks all the providers at once, each in its own thread.
+ * The first result wins unless a provider of higher priority is still
+ * running: those get lyricbar.providers.grace ms more to answer.
+ * The losers are cancelled and waited for, so that none of them outlives
+ * the job that has started it.
+ */
+static
+experimental::optional<ustring> race_providers(DB_playItem_t *track, const string &artist, const string &title) {
+	struct race {
+		mutex mtx;
+		condition_variable cv;
+		array<experimental::optional<ustring>, PROVIDERS_COUNT> results;
+		array<bool, PROVIDERS_COUNT> finished{};
+		cancel_flag cancelled = make_shared<atomic<bool>>(false);
+		vector<thread> racers;
+
+		~race() {
+			*cancelled = true;
+			for (auto &t : racers)
+				t.join();
+		}
+	} state;
+
+	for (size_t i = 0; i < PROVIDERS_COUNT; ++i) {
+		state.racers.emplace_back([&state, track, i, &artist, &title] {
+			experimental::optional<ustring> lyrics;
+			{
+				cancel_scope scope{state.cancelled};
+				lyrics = call_provider(i, track, artist, title);
 			}
+			lock_guard<mutex> lock(state.mtx);
+			state.results[i] = move(lyrics);
+			state.finished[i] = true;
+			state.cv.notify_all();
+		});
+	}
+
+	auto grace = chrono::milliseconds(max(0, deadbeef->conf_get_int("lyricbar.providers.grace", 500)));
+	chrono::steady_clock::time_point grace_end;
+	bool got_result = false;
+	experimental::optional<ustring> winner;
+
+	unique_lock<mutex> lock(state.mtx);
+	while (true) {
+		// the best result so far, provided all the more important providers have given up
+		size_t best = 0;
+		while (best < PROVIDERS_COUNT && state.finished[best] && !state.results[best])
+			++best;
+		if (best == PROVIDERS_COUNT)
+			break; // nobody has found anything
+		if (state.finished[best]) {
+			winner = move(state.results[best]);
+			debug_out << "lyricbar: '" << providers[best].name << "' has won the race\n";
+			break;
 		}
-	} catch (const exception &e) {
-		cerr << "lyricbar: couldn't parse XML, what(): " << e.what() << endl;
-		return {};
+
+		if (!got_result) {
+			for (size_t i = best + 1; i < PROVIDERS_COUNT; ++i) {
+				if (state.results[i]) {
+					got_result = true;
+					grace_end = chrono::steady_clock::now() + grace;
+					break;
+				}
+			}
+		}
+		if (got_result && chrono::steady_clock::now() >= grace_end) {
+			// take the most important of the arrived results
+			for (size_t i = best + 1; i < PROVIDERS_COUNT; ++i) {
+				if (state.results[i]) {
+					winner = move(state.results[i]);
+					debug_out << "lyricbar: '" << providers[i].name << "' has won the race\n";
+					break;
+				}
+			}
+			break;
+		}
+		if (job_cancelled())
+			break;
+		auto wake_up = chrono::steady_clock::now() + chrono::milliseconds(100);
+		state.cv.wait_until(lock, got_result ? min(wake_up, grace_end) : wake_up);
 	}
+	return winner;
+}
 
-	// although counter-intuitive, this seems to be the right way to do the parsing
-	const static regex r{R"(<lyrics>\s*([^]*?)\s*</lyrics>)"};
-	smatch match;
-	regex_search(raw_lyrics, match, r);
-	if (match.size() < 2) {
-		return {};
+namespace {
+
+/**
+ * Thrown to the joiners of a lookup that ended without a result.
+ */
+class lookup_abandoned : public runtime_error {
+public:
+	lookup_abandoned() : runtime_error("the lookup has been abandoned") {}
+};
+
+/**
+ * The lookup of a song registered in inflight; however it ends, it is
+ * forgotten and its joiners are given either the result or lookup_abandoned.
+ * To be created under inflight_mutex.
+ */
+class inflight_lookup {
+public:
+	explicit inflight_lookup(string key)
+		: key(move(key)) {
+		inflight.emplace(this->key, result.get_future().share());
+	}
+
+	~inflight_lookup() {
+		if (finished)
+			return;
+		{
+			lock_guard<mutex> lock(inflight_mutex);
+			inflight.erase(key);
+		}
+		result.set_exception(make_exception_ptr(lookup_abandoned{}));
+	}
+
+	inflight_lookup(const inflight_lookup &) = delete;
+	inflight_lookup &operator=(const inflight_lookup &) = delete;
+
+	void finish(const experimental::optional<ustring> &lyrics) {
+		{
+			lock_guard<mutex> lock(inflight_mutex);
+			inflight.erase(key);
+		}
+		result.set_value(lyrics);
+		finished = true;
+	}
+
+private:
+	string key;
+	promise<experimental::optional<ustring>> result;
+	bool finished = false;
+};
+
+} // namespace
+
+/**
+ * Asks the providers for the lyrics and caches them if succeeded.
+ * Concurrent lookups for the same song share a single fetch; if it ends
+ * without a result, e.g. because its track has been skipped, the next of
+ * them takes over.
+ */
+static
+experimental::optional<ustring> fetch_lyrics(DB_playItem_t *track, const string &artist, const string &title) {
+	string key = cache_key(artist, title);
+	unique_ptr<inflight_lookup> lookup;
+	while (!lookup) {
+		shared_future<experimental::optional<ustring>> pending;
+		{
+			lock_guard<mutex> lock(inflight_mutex);
+			auto it = inflight.find(key);
+			if (it != inflight.end())
+				pending = it->second;
+			else
+				lookup = make_unique<inflight_lookup>(key);
+		}
+		if (pending.valid()) {
+			debug_out << "joining the lookup in flight for '" << key << "'\n";
+			// the owner might be a prefetch, which goes on after this job is cancelled
+			while (pending.wait_for(chrono::milliseconds(100)) != future_status::ready) {
+				if (job_cancelled())
+					return {};
+			}
+			try {
+				return pending.get();
+			} catch (const lookup_abandoned &) {
+				debug_out << "the lookup in flight for '" << key << "' has been abandoned\n";
+			}
+		}
 	}
 
-	return ustring{match[1]};
+	experimental::optional<ustring> lyrics;
+	if (deadbeef->conf_get_int("lyricbar.providers.parallel", 0)) {
+		lyrics = race_providers(track, artist, title);
+	} else {
+		for (size_t i = 0; i < PROVIDERS_COUNT; ++i) {
+			if (job_cancelled())
+				break;
+			if ((lyrics = call_provider(i, track, artist, title)))
+				break;
+		}
+	}
+	if (lyrics) {
+		save_cached_lyrics(artist, title, *lyrics);
+	}
+	// a cancelled lookup proves nothing, the joiners still want the lyrics
+	if (lyrics || !job_cancelled())
+		lookup->finish(lyrics);
+	return lyrics;
+}
+
+/**
+ * Copies the artist and the title of the track.
+ * @return false if any of them is missing
+ */
+static
+bool get_artist_and_title(DB_playItem_t *track, string &artist, string &title) {
+	pl_lock_guard guard;
+	const char *artist_raw = deadbeef->pl_find_meta(track, "artist");
+	const char *title_raw  = deadbeef->pl_find_meta(track, "title");
+	if (!artist_raw || !title_raw)
+		return false;
+	artist = artist_raw;
+	title  = title_raw;
+	return true;
 }
 
 void update_lyrics(void *tr) {
@@ -294,34 +735,71 @@ void update_lyrics(void *tr) {
 		return;
 	}
 
-	const char *artist;
-	const char *title;
-	{
-		pl_lock_guard guard;
-		artist = deadbeef->pl_find_meta(track, "artist");
-		title  = deadbeef->pl_find_meta(track, "title");
-	}
-
-	if (artist && title) {
-		if (auto lyrics = load_cached_lyrics(artist, title)) {
-			set_lyrics(track, *lyrics);
+	string artist;
+	string title;
+	if (get_artist_and_title(track, artist, title)) {
+		auto lyrics = load_cached_lyrics(artist, title);
+		auto stats = get_cache_stats();
+		debug_out << "memory cache: " << stats.hits << " hits, " << stats.misses << " misses, "
+		          << stats.entries << " entries, " << stats.bytes << " bytes\n";
+		if (lyrics) {
+			set_lyrics(track, lyrics);
 			return;
 		}
 
 		set_lyrics(track, _("Loading..."));
 
 		// No lyrics in the tag or cache; try to get some and cache if succeeded
-		for (auto f : providers) {
-			if (auto lyrics = f(track)) {
-				set_lyrics(track, *lyrics);
-				save_cached_lyrics(artist, title, *lyrics);
-				return;
-			}
+		if (auto lyrics = fetch_lyrics(track, artist, title)) {
+			set_lyrics(track, *lyrics);
+			return;
 		}
 	}
 	set_lyrics(track, _("Lyrics not found"));
 }
 
+bool prefetch_lyrics(DB_playItem_t *track) {
+	string artist;
+	string title;
+	if (get_lyrics_from_metadata(track))
+		return true;
+	if (!get_artist_and_title(track, artist, title))
+		return false;
+	if (is_cached(artist.c_str(), title.c_str()))
+		return true;
+	debug_out << "lyricbar: prefetching the lyrics for '" << artist << " - " << title << "'\n";
+	return bool(fetch_lyrics(track, artist, title));
+}
+
+void prefetch_upcoming(DB_playItem_t *track) {
+	int count = deadbeef->conf_get_int("lyricbar.prefetch", 2);
+	int order = deadbeef->conf_get_int("playback.order", PLAYBACK_ORDER_LINEAR);
+	// the next track can only be guessed when the playlist is played in order
+	if (count <= 0 || (order != PLAYBACK_ORDER_LINEAR && order != PLAYBACK_ORDER_SHUFFLE_ALBUMS))
+		return;
+
+	vector<DB_playItem_t *> upcoming;
+	{
+		pl_lock_guard guard;
+		DB_playItem_t *current = track;
+		deadbeef->pl_item_ref(current);
+		for (int walked = 0; current && walked < 4 * count && upcoming.size() < size_t(count); ++walked) {
+			DB_playItem_t *next = deadbeef->pl_get_next(current, PL_MAIN);
+			deadbeef->pl_item_unref(current);
+			current = next;
+			if (current && deadbeef->pl_get_item_duration(current) > 0) {
+				deadbeef->pl_item_ref(current);
+				upcoming.push_back(current);
+			}
+		}
+		if (current)
+			deadbeef->pl_item_unref(current);
+	}
+	lyrics_workers_prefetch(upcoming);
+	for (auto item : upcoming)
+		deadbeef->pl_item_unref(item);
+}
+
 /**
  * Creates the directory tree.
  * @param name the directory path, including trailing slash
@@ -340,8 +818,86 @@ int mkpath(const string &name, mode_t mode) {
 	return 0;
 }
 
+using song_list = vector<pair<string, string>>;
+
+/**
+ * Removes the lyrics of the songs from the cache, as well as the remembered
+ * misses, so that the lyrics are looked up again; runs on a worker.
+ */
+static
+void remove_from_cache(const song_list &songs) {
+	size_t removed = 0;
+	size_t i = 0;
+	for (; i < songs.size() && !job_cancelled(); ++i) {
+		const auto &song = songs[i];
+		for (const auto &provider : providers)
+			remove_cached_miss(miss_source(provider), song.first, song.second);
+		if (remove_cached_lyrics(song.first, song.second))
+			++removed;
+		if ((i + 1) % 1000 == 0)
+			debug_out << "lyricbar: " << i + 1 << '/' << songs.size() << " cache entries processed\n";
+	}
+	cerr << "lyricbar: removed " << removed << " of " << i << " lyrics from the cache\n";
+}
+
+extern "C"
+bool has_cache_entries(const char *artist, const char *title) {
+	if (may_be_cached(artist, title))
+		return true;
+	if (!artist || !title)
+		return false;
+	return any_of(begin(providers), end(providers), [&](const lyrics_provider &provider) {
+		return may_have_cached_miss(miss_source(provider), artist, title);
+	});
+}
+
+/**
+ * Collects the referenced items of the playlist, all or only the selected ones.
+ */
+static
+vector<DB_playItem_t *> collect_items(ddb_playlist_t *playlist, bool selected_only) {
+	vector<DB_playItem_t *> items;
+	pl_lock_guard guard;
+	DB_playItem_t *current = deadbeef->plt_get_first(playlist, PL_MAIN);
+	while (current) {
+		DB_playItem_t *next = deadbeef->pl_get_next(current, PL_MAIN);
+		if (!selected_only || deadbeef->pl_is_selected(current))
+			items.push_back(current);
+		else
+			deadbeef->pl_item_unref(current);
+		current = next;
+	}
+	return items;
+}
+
+int fetch_lyrics_action(DB_plugin_action_t *, int ctx) {
+	ddb_playlist_t *playlist = nullptr;
+	if (ctx == DDB_ACTION_CTX_SELECTION)
+		playlist = deadbeef->plt_get_curr();
+	else if (ctx == DDB_ACTION_CTX_PLAYLIST)
+		playlist = deadbeef->action_get_playlist();
+	if (!playlist)
+		return 0;
+
+	auto items = collect_items(playlist, ctx == DDB_ACTION_CTX_SELECTION);
+	deadbeef->plt_unref(playlist);
+	if (!items.empty())
+		lyrics_workers_bulk(move(items));
+	return 0;
+}
+
+int stop_fetching_action(DB_plugin_action_t *, int) {
+	lyrics_workers_bulk_cancel();
+	return 0;
+}
+
 int remove_from_cache_action(DB_plugin_action_t *, int ctx) {
-	if (ctx == DDB_ACTION_CTX_SELECTION) {
+	if (ctx != DDB_ACTION_CTX_SELECTION)
+		return 0;
+
+	// only gather the songs under the lock, the file system is touched later
+	song_list songs;
+	{
 		pl_lock_guard guard;
 
 		ddb_playlist_t *playlist = deadbeef->plt_get_curr();
@@ -351,8 +907,8 @@ int remove_from_cache_action(DB_plugin_action_t *, int ctx) {
 				if (deadbeef->pl_is_selected (current)) {
 					const char *artist = deadbeef->pl_find_meta(current, "artist");
 					const char *title  = deadbeef->pl_find_meta(current, "title");
-					if (is_cached(artist, title))
-						remove(cached_filename(artist, title).c_str());
+					if (artist && title)
+						songs.emplace_back(artist, title);
 				}
 				DB_playItem_t *next = deadbeef->pl_get_next(current, PL_MAIN);
 				deadbeef->pl_item_unref(current);
@@ -361,5 +917,9 @@ int remove_from_cache_action(DB_plugin_action_t *, int ctx) {
 			deadbeef->plt_unref(playlist);
 		}
 	}
+	if (songs.empty())
+		return 0;
+
+	lyrics_workers_run([songs = move(songs)] { remove_from_cache(songs); });
 	return 0;
 }
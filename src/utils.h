@@ -32,16 +32,39 @@ bool is_playing(DB_playItem_t *track);
 
 void update_lyrics(void *tr);
 
+/**
+ * Fetches the lyrics for the track into the cache unless they are there already.
+ * @return true if the track has lyrics
+ */
+bool prefetch_lyrics(DB_playItem_t *track);
+
+/**
+ * Queues the prefetching for the tracks following the given one.
+ */
+void prefetch_upcoming(DB_playItem_t *track);
+
 std::experimental::optional<Glib::ustring> download_lyrics_from_lyricwiki(DB_playItem_t *track);
 std::experimental::optional<Glib::ustring> get_lyrics_from_script(DB_playItem_t *track);
 
+/**
+ * Recompiles the custom lyrics fetching command if it has been changed.
+ */
+void reload_custom_command();
+
 int mkpath(const std::string &name, mode_t mode);
 
 extern "C" {
 #endif // __cplusplus
+/**
+ * Tells whether the cache might have the lyrics of the song or a remembered
+ * miss for it, i.e. whether removing it from the cache might change anything.
+ * Never touches the disk.
+ */
+bool has_cache_entries(const char *artist, const char *title);
+
 int remove_from_cache_action(DB_plugin_action_t *, int ctx);
-bool is_cached(const char *artist, const char *title);
-void ensure_lyrics_path_exists();
+int fetch_lyrics_action(DB_plugin_action_t *, int ctx);
+int stop_fetching_action(DB_plugin_action_t *, int ctx);
 
 #ifdef __cplusplus
 }
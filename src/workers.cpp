@@ -0,0 +1,411 @@
+#include "workers.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "debug.h"
+#include "utils.h"
+
+using namespace std;
+
+static thread_local cancel_flag current_flag;
+
+bool job_cancelled() {
+	return current_flag && *current_flag;
+}
+
+cancel_scope::cancel_scope(cancel_flag flag)
+	: previous(move(current_flag)) {
+	current_flag = move(flag);
+}
+
+cancel_scope::~cancel_scope() {
+	current_flag = move(previous);
+}
+
+namespace {
+
+constexpr size_t WORKERS_COUNT = 2;
+
+struct running_job {
+	DB_playItem_t *track; // nullptr for the tasks
+	cancel_flag cancelled;
+	bool background;
+};
+
+/**
+ * Runs the lyrics updates for the playing tracks and, with a lower priority,
+ * the prefetching of the upcoming ones and the maintenance tasks. One worker
+ * is always kept free of the background jobs.
+ */
+class worker_pool {
+public:
+	void submit(DB_playItem_t *track);
+	void prefetch(const vector<DB_playItem_t *> &tracks);
+	void bulk(vector<DB_playItem_t *> tracks);
+	void cancel_bulk();
+	bool bulk_progress(size_t &processed, size_t &total);
+	void run_task(function<void()> task);
+	void stop();
+
+private:
+	void start_workers();
+	void run();
+	void run_bulk(cancel_flag cancelled);
+	DB_playItem_t *next_bulk_track();
+
+	mutex mtx;
+	condition_variable cv;
+	deque<DB_playItem_t *> queue;      // the items are referenced
+	deque<DB_playItem_t *> background; // the items are referenced
+	deque<function<void()>> tasks;
+	size_t background_running = 0;
+	vector<running_job> running;
+	vector<thread> workers;
+	// a single bulk run at a time, the later selections join it
+	deque<DB_playItem_t *> bulk_queue; // the items are referenced
+	thread bulk_coordinator;
+	bool bulk_active = false;
+	cancel_flag bulk_cancelled = make_shared<atomic<bool>>(false);
+	size_t bulk_total = 0;
+	atomic<size_t> bulk_processed{0};
+	atomic<size_t> bulk_found{0};
+	bool stopping = false;
+};
+
+void worker_pool::start_workers() {
+	if (workers.empty()) {
+		for (size_t i = 0; i < WORKERS_COUNT; ++i)
+			workers.emplace_back(&worker_pool::run, this);
+	}
+}
+
+void worker_pool::submit(DB_playItem_t *track) {
+	lock_guard<mutex> lock(mtx);
+	if (stopping)
+		return;
+
+	// nobody waits for the lyrics of the tracks skipped already
+	for (auto it = queue.begin(); it != queue.end();) {
+		if (*it == track || !is_playing(*it)) {
+			deadbeef->pl_item_unref(*it);
+			it = queue.erase(it);
+		} else {
+			++it;
+		}
+	}
+	for (auto &job : running) {
+		if (!job.background && job.track != track && !is_playing(job.track))
+			*job.cancelled = true;
+	}
+	deadbeef->pl_item_ref(track);
+	queue.push_back(track);
+
+	start_workers();
+	cv.notify_one();
+}
+
+void worker_pool::prefetch(const vector<DB_playItem_t *> &tracks) {
+	lock_guard<mutex> lock(mtx);
+	if (stopping)
+		return;
+
+	// the previous guesses are outdated
+	for (auto track : background)
+		deadbeef->pl_item_unref(track);
+	background.clear();
+	for (auto track : tracks) {
+		deadbeef->pl_item_ref(track);
+		background.push_back(track);
+	}
+
+	start_workers();
+	cv.notify_one();
+}
+
+void worker_pool::run_task(function<void()> task) {
+	lock_guard<mutex> lock(mtx);
+	if (stopping)
+		return;
+	tasks.push_back(move(task));
+	start_workers();
+	cv.notify_one();
+}
+
+/**
+ * Fetches the lyrics for the tracks in the background with a bounded
+ * number of threads of its own, reporting the progress to stderr.
+ * If a bulk run is going on already, the tracks are queued into it;
+ * if it has been stopped and is winding down, they start a fresh round of it.
+ */
+void worker_pool::bulk(vector<DB_playItem_t *> tracks) {
+	lock_guard<mutex> lock(mtx);
+	if (stopping) {
+		for (auto track : tracks)
+			deadbeef->pl_item_unref(track);
+		return;
+	}
+
+	bulk_queue.insert(bulk_queue.end(), tracks.begin(), tracks.end());
+	if (bulk_active && !*bulk_cancelled) {
+		bulk_total += tracks.size();
+		return;
+	}
+	if (bulk_active) {
+		// the coordinator picks the new flag up once the stopped round is over
+		bulk_total = tracks.size();
+		bulk_processed = 0;
+		bulk_found = 0;
+		bulk_cancelled = make_shared<atomic<bool>>(false);
+		return;
+	}
+	// the previous run is over, only its coordinator is left to be joined
+	if (bulk_coordinator.joinable())
+		bulk_coordinator.join();
+	bulk_active = true;
+	bulk_total = tracks.size();
+	bulk_processed = 0;
+	bulk_found = 0;
+	bulk_cancelled = make_shared<atomic<bool>>(false);
+	bulk_coordinator = thread(&worker_pool::run_bulk, this, bulk_cancelled);
+}
+
+/**
+ * Drops the queued tracks of the bulk run; the fetches already started
+ * are cancelled.
+ */
+void worker_pool::cancel_bulk() {
+	lock_guard<mutex> lock(mtx);
+	if (!bulk_active)
+		return;
+	*bulk_cancelled = true;
+	for (auto track : bulk_queue)
+		deadbeef->pl_item_unref(track);
+	bulk_queue.clear();
+}
+
+bool worker_pool::bulk_progress(size_t &processed, size_t &total) {
+	lock_guard<mutex> lock(mtx);
+	processed = bulk_processed;
+	total = bulk_total;
+	return bulk_active;
+}
+
+/**
+ * @return the next track of the bulk run, referenced; nullptr if there are no more
+ */
+DB_playItem_t *worker_pool::next_bulk_track() {
+	lock_guard<mutex> lock(mtx);
+	if (job_cancelled() || bulk_queue.empty())
+		return nullptr;
+	DB_playItem_t *track = bulk_queue.front();
+	bulk_queue.pop_front();
+	return track;
+}
+
+void worker_pool::run_bulk(cancel_flag cancelled) {
+	using clock = chrono::steady_clock;
+	auto start = clock::now();
+	auto report = [&](const char *what, size_t total) {
+		double seconds = chrono::duration<double>(clock::now() - start).count();
+		size_t processed = bulk_processed;
+		cerr << "lyricbar: " << what << ' ' << processed << '/' << total << " tracks, "
+		     << bulk_found << " with lyrics, " << (seconds > 0 ? processed / seconds : 0) << " tracks/s\n";
+	};
+
+	while (true) {
+		size_t threads_count = max(1, deadbeef->conf_get_int("lyricbar.bulk.threads", 4));
+		{
+			lock_guard<mutex> lock(mtx);
+			threads_count = min(threads_count, bulk_queue.size());
+		}
+
+		mutex progress_mutex;
+		condition_variable progress_cv;
+		size_t active = threads_count;
+
+		vector<thread> fetchers;
+		for (size_t i = 0; i < threads_count; ++i) {
+			fetchers.emplace_back([&] {
+				{
+					cancel_scope scope{cancelled};
+					while (DB_playItem_t *track = next_bulk_track()) {
+						bool found = prefetch_lyrics(track);
+						// the counters might belong to the next round already
+						if (!*cancelled) {
+							if (found)
+								++bulk_found;
+							++bulk_processed;
+						}
+						deadbeef->pl_item_unref(track);
+					}
+				}
+				lock_guard<mutex> lock(progress_mutex);
+				--active;
+				progress_cv.notify_all();
+			});
+		}
+		{
+			unique_lock<mutex> lock(progress_mutex);
+			while (!progress_cv.wait_for(lock, chrono::seconds(5), [&] { return active == 0; })) {
+				size_t total;
+				{
+					lock_guard<mutex> pool_lock(mtx);
+					total = bulk_total;
+				}
+				report("fetching lyrics:", total);
+			}
+		}
+		for (auto &t : fetchers)
+			t.join();
+
+		size_t total;
+		bool restarted;
+		{
+			lock_guard<mutex> lock(mtx);
+			// the tracks queued after the fetchers have run out get another round
+			if (!*cancelled && !bulk_queue.empty())
+				continue;
+			restarted = cancelled != bulk_cancelled;
+			if (restarted)
+				cancelled = bulk_cancelled;
+			else
+				bulk_active = false;
+			total = bulk_total;
+		}
+		if (restarted) {
+			cerr << "lyricbar: fetching lyrics again after a stop\n";
+			start = clock::now();
+			continue;
+		}
+		report(*cancelled ? "stopped fetching lyrics after" : "lyrics fetched for", total);
+		return;
+	}
+}
+
+void worker_pool::stop() {
+	vector<thread> to_join;
+	thread bulk_to_join;
+	{
+		lock_guard<mutex> lock(mtx);
+		stopping = true;
+		*bulk_cancelled = true;
+		for (auto track : bulk_queue)
+			deadbeef->pl_item_unref(track);
+		bulk_queue.clear();
+		bulk_to_join.swap(bulk_coordinator);
+		for (auto &job : running)
+			*job.cancelled = true;
+		for (auto track : queue)
+			deadbeef->pl_item_unref(track);
+		queue.clear();
+		for (auto track : background)
+			deadbeef->pl_item_unref(track);
+		background.clear();
+		tasks.clear();
+		to_join.swap(workers);
+	}
+	cv.notify_all();
+	for (auto &t : to_join)
+		t.join();
+	if (bulk_to_join.joinable())
+		bulk_to_join.join();
+}
+
+void worker_pool::run() {
+	while (true) {
+		DB_playItem_t *track = nullptr;
+		function<void()> task;
+		bool is_background;
+		auto cancelled = make_shared<atomic<bool>>(false);
+		{
+			unique_lock<mutex> lock(mtx);
+			cv.wait(lock, [this] {
+				return stopping || !queue.empty()
+				       || ((!background.empty() || !tasks.empty()) && background_running + 1 < WORKERS_COUNT);
+			});
+			if (stopping)
+				return;
+			is_background = queue.empty();
+			if (!is_background) {
+				track = queue.front();
+				queue.pop_front();
+			} else if (!background.empty()) {
+				track = background.front();
+				background.pop_front();
+			} else {
+				task = move(tasks.front());
+				tasks.pop_front();
+			}
+			if (is_background)
+				++background_running;
+			running.push_back({track, cancelled, is_background});
+		}
+		if (task) {
+			cancel_scope scope{cancelled};
+			task();
+		} else if (is_background) {
+			cancel_scope scope{cancelled};
+			prefetch_lyrics(track);
+		} else if (is_playing(track)) {
+			cancel_scope scope{cancelled};
+			update_lyrics(track);
+		} else {
+			debug_out << "lyricbar: dropping a stale job\n";
+		}
+		{
+			lock_guard<mutex> lock(mtx);
+			running.erase(find_if(running.begin(), running.end(),
+			                      [&](const running_job &job) { return job.cancelled == cancelled; }));
+			if (is_background) {
+				--background_running;
+				cv.notify_one();
+			}
+		}
+		if (track)
+			deadbeef->pl_item_unref(track);
+	}
+}
+
+worker_pool pool;
+
+} // namespace
+
+extern "C"
+void lyrics_workers_submit(DB_playItem_t *track) {
+	pool.submit(track);
+}
+
+void lyrics_workers_prefetch(const vector<DB_playItem_t *> &tracks) {
+	pool.prefetch(tracks);
+}
+
+void lyrics_workers_bulk(vector<DB_playItem_t *> tracks) {
+	pool.bulk(move(tracks));
+}
+
+extern "C"
+void lyrics_workers_bulk_cancel() {
+	pool.cancel_bulk();
+}
+
+extern "C"
+bool lyrics_workers_bulk_progress(size_t *processed, size_t *total) {
+	return pool.bulk_progress(*processed, *total);
+}
+
+void lyrics_workers_run(function<void()> task) {
+	pool.run_task(move(task));
+}
+
+extern "C"
+void lyrics_workers_stop() {
+	pool.stop();
+}
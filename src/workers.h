@@ -0,0 +1,90 @@
+#pragma once
+#ifndef LYRICBAR_WORKERS_H
+#define LYRICBAR_WORKERS_H
+
+#include <deadbeef/deadbeef.h>
+
+#ifdef __cplusplus
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+#else
+#include <stdbool.h>
+#include <stddef.h>
+#endif
+
+#ifdef __cplusplus
+using cancel_flag = std::shared_ptr<std::atomic<bool>>;
+
+/**
+ * Tells whether the job running on the current thread is not needed anymore,
+ * e.g. because the track it fetches the lyrics for has been skipped.
+ * Long operations are supposed to check it and give up early.
+ */
+bool job_cancelled();
+
+/**
+ * Makes the flag the current thread's cancellation flag for its lifetime.
+ */
+class cancel_scope {
+public:
+	explicit cancel_scope(cancel_flag flag);
+	~cancel_scope();
+
+	cancel_scope(const cancel_scope &) = delete;
+	cancel_scope &operator=(const cancel_scope &) = delete;
+
+private:
+	cancel_flag previous;
+};
+
+/**
+ * Replaces the pending background jobs with warming up the cache for the tracks.
+ */
+void lyrics_workers_prefetch(const std::vector<DB_playItem_t *> &tracks);
+
+/**
+ * Starts warming up the cache for all the tracks at once, or queues them into
+ * the run going on already.
+ * @param tracks the referenced items, the references are taken over
+ */
+void lyrics_workers_bulk(std::vector<DB_playItem_t *> tracks);
+
+/**
+ * Queues the task as a background job. It is dropped if the workers are
+ * stopped before it starts; once running, it is cancelled and waited for.
+ */
+void lyrics_workers_run(std::function<void()> task);
+
+extern "C" {
+#endif
+
+/**
+ * Queues the lyrics update for the track.
+ * The jobs queued for the tracks that are not playing anymore are dropped,
+ * the running ones are cancelled.
+ */
+void lyrics_workers_submit(DB_playItem_t *track);
+
+/**
+ * Discards the pending jobs and waits for the running ones to finish.
+ */
+void lyrics_workers_stop();
+
+/**
+ * Stops warming up the cache for many tracks; the remaining ones are dropped.
+ */
+void lyrics_workers_bulk_cancel();
+
+/**
+ * Tells how many of the tracks queued for warming up the cache are done.
+ * @return false if nothing is being warmed up
+ */
+bool lyrics_workers_bulk_progress(size_t *processed, size_t *total);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LYRICBAR_WORKERS_H